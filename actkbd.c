@@ -10,6 +10,11 @@
 
 #include "actkbd.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+
 
 /* Verbosity level */
 int verbose = 0;
@@ -26,14 +31,15 @@ int uselog = 0;
 /* Maximum number of keys */
 int maxkey = 0;
 
-/* Device grab state */
-int grabbed = 0;
+/* All open devices */
+kbd_t *kbds = NULL;
 
-/* Ignore release events */
-int ignrel = 0;
+/* The device whose events are being handled */
+kbd_t *kbd = NULL;
 
-/* Keyboard device name */
-char *device = NULL;
+/* Keyboard device names */
+char **devices = NULL;
+int devcnt = 0;
 
 /* Configuration file name */
 char *config = NULL;
@@ -41,24 +47,53 @@ char *config = NULL;
 /* PID file name */
 char *pidfile = NULL;
 
+/* Device match criteria */
+devmatch_t devmatch = { NULL, NULL, -1, -1 };
+
+/* Every key event is reported */
+static int allkeys = 0;
+
+/* Stack size of the reconfiguration thread - kept small, since it is locked
+ * into memory in the low-latency mode */
+#define RELOAD_STACK	(256 * 1024)
+
+/* Reconfiguration requests, handled by the reconfiguration thread */
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reload_cond = PTHREAD_COND_INITIALIZER;
+static int reload_req = 0;
+
 
 static int usage() {
     lprintf(
 	"actkbd Version %s\n"
 	"Usage: actkbd [options]\n"
 	"    Options are as follows:\n"
+	"        -a, --all               Use all detected keyboards\n"
 	"        -c, --config <file>     Specify the configuration file to use\n"
+	"        -C, --compile           Compile the configuration file and exit\n"
 	"        -D, --daemon            Launch in daemon mode\n"
-	"        -d, --device <device>   Specify the device to use\n"
+	"        -d, --device <device>   Specify a device to use (may be repeated)\n"
+	"        -f, --forkserver        Start the commands through a fork server\n"
+	"        -g, --grab              Grab the devices from the start\n"
+	"        -G, --cgroup <dir>      Place the commands in a cgroup\n"
 	"        -h, --help              Show this help text\n"
+	"        -I, --id <vendor[:product]>\n"
+	"                                Only detect devices with these IDs (hex)\n"
+	"        -m, --maxcmds <count>   Limit the number of running commands\n"
 	"        -n, --noexec            Do not execute any commands\n"
+	"        -N, --name <pattern>    Only detect devices with a matching name\n"
 	"        -p, --pidfile <file>    Use a file to store the PID\n"
+	"        -P, --phys <pattern>    Only detect devices with a matching physical path\n"
 	"        -q, --quiet             Suppress all console messages\n"
+	"        -r[priority]\n"
+	"        --realtime=[priority]   Low-latency mode, with an optional real-time\n"
+	"                                priority (1-99)\n"
 	"        -v[level]\n"
 	"        --verbose=[level]       Specify the verbosity level (0-9)\n"
 	"        -V, --version           Show version information\n"
 	"        -x, --showexec          Report executed commands\n"
 	"        -s, --showkey           Report key presses\n"
+	"        -u, --uring             Use io_uring for the event loop\n"
 	"        -l, --syslog            Use the syslog facilities for logging\n"
     , VERSION);
 
@@ -66,55 +101,194 @@ static int usage() {
 }
 
 
-/* Allow SIGHUP to cause reconfiguration */
-void on_hup(int signum) {
-    int ret;
+/* Add a device to the list of devices to use */
+int add_device(char *name) {
+    char **tmp;
 
-    if ((verbose > 0) || detach)
-	lprintf("Reconfiguration requested\n");
+    if (name == NULL)
+	return MEMERR;
 
-    if (verbose > 1)
-	lprintf("Discarding old configuration\n");
+    tmp = (char **)(realloc(devices, (devcnt + 1) * sizeof(char *)));
+    if (tmp == NULL)
+	return MEMERR;
 
-    close_config();
-    free_key_mask();
-    free_ign_mask();
+    devices = tmp;
+    devices[devcnt++] = name;
+
+    return OK;
+}
 
-    if (verbose > 1)
-	lprintf("Reading new configuration\n");
 
-    if ((ret = open_config()) != OK)
-	exit(ret);
-    if ((ret = init_key_mask()) != OK)
-	exit(ret);
-    if ((ret = init_ign_mask()) != OK)
-	exit(ret);
+/* Only have the kernel report the key events that can be used by the rule
+ * set in use */
+static void set_filter() {
+    keymask_t keys;
+
+    if (allkeys)
+	memset(&keys, 0xff, sizeof(keymask_t));
+    else
+	config_keys(&keys);
+    filter_dev(&keys);
+}
+
+
+/* Read the key state of the current device again, in case some events have
+ * been missed */
+static void resync_keys() {
+    keymask_t state, avail;
+    int n;
+
+    kbd->resync = 0;
+    if (get_key_state(&state, &avail) != OK)
+	return;
+
+    /* The events of a forwarded device are matched after the remapping */
+    if (kbd->grabbed && virtual_output() && (remap_mask(&state) == OK))
+	remap_mask(&avail);
+
+    n = sync_key_mask(&state, &avail);
+    ++kbd->resyncs;
+    kbd->fixed += n;
+
+    if ((n > 0) && (verbose > 0))
+	lprintf("Resynchronised %i keys of %s\n", n, kbd->name);
+}
+
+
+/* Record the delay between the kernel timestamp of an event and the moment
+ * it is handled */
+static void record_delay(int64_t stamp) {
+    struct timespec ts;
+    int64_t delay;
+    int b = 0;
+
+    if (stamp == 0)
+	return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    delay = (int64_t)(ts.tv_sec) * 1000000000 + ts.tv_nsec - stamp;
+    if (delay < 0)
+	delay = 0;
+
+    while ((b < DELAY_BUCKETS - 1) && (delay >= ((int64_t)1000 << b)))
+	++b;
+    ++kbd->delays[b];
+    kbd->delaysum += delay;
+    if ((uint64_t)delay > kbd->delaymax)
+	kbd->delaymax = delay;
+
+    if (verbose > 3)
+	lprintf("Event delay: %lli us\n", (long long)(delay / 1000));
+}
+
+
+/* Allow SIGUSR1 to report the device and command statistics */
+static void report_stats() {
+    unsigned long cnt;
+    kbd_t *dev;
+    int b;
+
+    for (dev = kbds; dev != NULL; dev = dev->next) {
+	lprintf("Device %s: %lu overruns, %lu resynchronisations, %lu keys corrected\n",
+		dev->name, dev->overruns, dev->resyncs, dev->fixed);
+
+	for (cnt = 0, b = 0; b < DELAY_BUCKETS; ++b)
+	    cnt += dev->delays[b];
+	if (cnt == 0)
+	    continue;
+
+	lprintf("Device %s: %lu events, average delay %llu us, maximum %llu us\n",
+		dev->name, cnt, (unsigned long long)(dev->delaysum / cnt / 1000),
+		(unsigned long long)(dev->delaymax / 1000));
+	lprintf("Device %s: delays", dev->name);
+	for (b = 0; b < DELAY_BUCKETS - 1; ++b)
+	    if (dev->delays[b] > 0)
+		lprintf(" <%ius:%lu", 1 << b, dev->delays[b]);
+	if (dev->delays[b] > 0)
+	    lprintf(" >=%ius:%lu", 1 << (b - 1), dev->delays[b]);
+	lprintf("\n");
+    }
+
+    report_cmds();
+}
+
+
+/* Reduce the event handling latency. The memory is locked, and the calling
+ * thread gets a real-time priority if one is given - the commands that it
+ * starts are reset to the normal scheduling policy */
+static void set_realtime(int prio) {
+    struct sched_param sp;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+	lprintf("Warning: could not lock the memory: %s\n", strerror(errno));
+
+    if (prio <= 0)
+	return;
+
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = prio;
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &sp) != 0)
+	lprintf("Warning: could not set the real-time priority: %s\n", strerror(errno));
+    else if (verbose > 1)
+	lprintf("Using real-time priority %i\n", prio);
+}
+
+
+/* The new configuration is loaded in this thread and picked up by the event
+ * loop, which keeps running with the old one in the meantime */
+static void *reload_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+	pthread_mutex_lock(&reload_lock);
+	while (!reload_req)
+	    pthread_cond_wait(&reload_cond, &reload_lock);
+	reload_req = 0;
+	pthread_mutex_unlock(&reload_lock);
+
+	if (verbose > 1)
+	    lprintf("Reading new configuration\n");
+
+	if (reload_config() != OK)
+	    continue;
+
+	/* Have the event loop switch over without waiting for an event */
+	wake_loop();
+    }
+
+    return NULL;
+}
+
 
-    if (verbose > 1)
-	lprintf("Reconfiguration complete\n");
+/* Allow SIGHUP to cause reconfiguration */
+static void request_reload() {
+    if ((verbose > 0) || detach)
+	lprintf("Reconfiguration requested\n");
 
-    return;
+    pthread_mutex_lock(&reload_lock);
+    reload_req = 1;
+    pthread_cond_signal(&reload_cond);
+    pthread_mutex_unlock(&reload_lock);
 }
 
 
 /* Allow SIGTERM to cause graceful termination */
-void on_term(int signum) {
+static void terminate() {
+    stop_server();
     close_config();
-    close_dev();
-    free_key_mask();
-    free_ign_mask();
+    close_output();
+    while (kbds != NULL) {
+	free_match(kbds);
+	close_dev(kbds);
+    }
 
     if (detach)
-	lprintf("actkbd %s terminating for %s\n", VERSION, device);
+	lprintf("actkbd %s terminating\n", VERSION);
 
     closelog();
 
     if (pidfile != NULL)
 	unlink(pidfile);
-
-    exit(OK);
-
-    return;
 }
 
 
@@ -139,36 +313,279 @@ static int write_pid() {
 }
 
 
-/* External command execution */
-static int ext_exec(char *cmd, int noexec, int showexec) {
-    if ((verbose > 0) || showexec)
-	lprintf("Executing: %s\n", cmd);
+/* External command execution - the command is not waited for */
+static int ext_exec(key_cmd *cmd, int noexec, int showexec) {
+    int log = (verbose > 0) || showexec;
+
     if (!noexec)
-	return system(cmd);
+	return spawn_cmd(cmd, log);
+
+    if (log)
+	lprintf("Executing: %s\n", cmd->command);
 
-    return 0;
+    return OK;
 }
 
 
-int main(int argc, char **argv) {
-    int ret, key, type;
+/* Attribute names, for reporting */
+static const char *attr_name[] = {
+    [ATTR_EXEC] = "exec",
+    [ATTR_GRAB] = "grab",
+    [ATTR_UNGRAB] = "ungrab",
+    [ATTR_IGNREL] = "ignrel",
+    [ATTR_RCVREL] = "rcvrel",
+    [ATTR_ALLREL] = "allrel",
+    [ATTR_KEY] = "key",
+    [ATTR_REL] = "rel",
+    [ATTR_REP] = "rep",
+    [ATTR_LEDON] = "ledon",
+    [ATTR_LEDOFF] = "ledoff",
+    [ATTR_SET] = "set",
+    [ATTR_UNSET] = "unset",
+    [ATTR_REMAP] = "remap",
+    [ATTR_MAX] = "max",
+    [ATTR_TIMEOUT] = "timeout"
+};
+
+
+/* Report an executed attribute, with its argument if it is not negative */
+static void lprint_attr(int type, int arg) {
+    char opt[32] = { '\0' };
+
+    if (arg >= 0)
+	snprintf(opt, 32, "%i", arg);
+    lprintf("Attribute: %s(%s)\n", attr_name[type], opt);
+}
+
+
+/* The attribute dispatch loop is threaded where labels can be used as
+ * values, and a plain switch elsewhere */
+#ifdef __GNUC__
+#define DISPATCH	goto *dispatch[attr->type];
+#define ACTION(type)	L_##type
+#define NEXT		++attr; goto *dispatch[attr->type]
+#else
+#define DISPATCH	LOOP: switch (attr->type)
+#define ACTION(type)	case type
+#define NEXT		++attr; goto LOOP
+#endif
+
+/* Attribute implementation. Returns non-zero if the command was executed */
+static int run_attrs(key_cmd *cmd, int key, int noexec, int showexec, int *norel) {
+#ifdef __GNUC__
+    static void *dispatch[] = {
+	[ATTR_EXEC] = &&L_ATTR_EXEC,
+	[ATTR_GRAB] = &&L_ATTR_GRAB,
+	[ATTR_UNGRAB] = &&L_ATTR_UNGRAB,
+	[ATTR_IGNREL] = &&L_ATTR_IGNREL,
+	[ATTR_RCVREL] = &&L_ATTR_RCVREL,
+	[ATTR_ALLREL] = &&L_ATTR_ALLREL,
+	[ATTR_KEY] = &&L_ATTR_KEY,
+	[ATTR_REL] = &&L_ATTR_REL,
+	[ATTR_REP] = &&L_ATTR_REP,
+	[ATTR_LEDON] = &&L_ATTR_LEDON,
+	[ATTR_LEDOFF] = &&L_ATTR_LEDOFF,
+	[ATTR_SET] = &&L_ATTR_SET,
+	[ATTR_UNSET] = &&L_ATTR_UNSET,
+	[ATTR_REMAP] = &&L_ATTR_REMAP,
+	[ATTR_MAX] = &&L_ATTR_MAX,
+	[ATTR_TIMEOUT] = &&L_ATTR_TIMEOUT,
+	[ATTR_END] = &&L_ATTR_END
+    };
+#endif
+    attr_t *attr = cmd->attrs;
+    int tmp, exec_ok = 0, log = (verbose > 0) || showexec;
+
+    DISPATCH {
+	ACTION(ATTR_EXEC):
+	    /* The generated events go out in order with the other actions */
+	    flush_keys();
+	    ext_exec(cmd, noexec, showexec);
+	    exec_ok = 1;
+	    if (log)
+		lprint_attr(ATTR_EXEC, -1);
+	    NEXT;
+	ACTION(ATTR_GRAB):
+	    flush_keys();
+	    grab_dev();
+	    if (log)
+		lprint_attr(ATTR_GRAB, -1);
+	    NEXT;
+	ACTION(ATTR_UNGRAB):
+	    flush_keys();
+	    ungrab_dev();
+	    if (log)
+		lprint_attr(ATTR_UNGRAB, -1);
+	    NEXT;
+	ACTION(ATTR_IGNREL):
+	    copy_key_to_ign_mask();
+	    kbd->ignrel = 1;
+	    if (log)
+		lprint_attr(ATTR_IGNREL, -1);
+	    NEXT;
+	ACTION(ATTR_RCVREL):
+	    kbd->ignrel = 0;
+	    if (log)
+		lprint_attr(ATTR_RCVREL, -1);
+	    NEXT;
+	ACTION(ATTR_ALLREL):
+	    clear_key_mask();
+	    if (log)
+		lprint_attr(ATTR_ALLREL, -1);
+	    NEXT;
+	ACTION(ATTR_KEY):
+	    tmp = (attr->opt >= 0)?attr->opt:key;
+	    snd_key(tmp, KEY);
+	    if (log)
+		lprint_attr(ATTR_KEY, tmp);
+	    NEXT;
+	ACTION(ATTR_REL):
+	    tmp = (attr->opt >= 0)?attr->opt:key;
+	    snd_key(tmp, REL);
+	    if (log)
+		lprint_attr(ATTR_REL, tmp);
+	    NEXT;
+	ACTION(ATTR_REP):
+	    tmp = (attr->opt >= 0)?attr->opt:key;
+	    snd_key(tmp, REP);
+	    if (log)
+		lprint_attr(ATTR_REP, tmp);
+	    NEXT;
+	ACTION(ATTR_LEDON):
+	    set_led(attr->opt, 1);
+	    if (log)
+		lprint_attr(ATTR_LEDON, attr->opt);
+	    NEXT;
+	ACTION(ATTR_LEDOFF):
+	    set_led(attr->opt, 0);
+	    if (log)
+		lprint_attr(ATTR_LEDOFF, attr->opt);
+	    NEXT;
+	ACTION(ATTR_SET):
+	    tmp = (attr->opt >= 0)?attr->opt:key;
+	    if (tmp == key)
+		*norel = 1;
+	    set_key_bit(tmp, 1);
+	    set_virt_bit(tmp, 1);
+	    if (log)
+		lprint_attr(ATTR_SET, tmp);
+	    NEXT;
+	ACTION(ATTR_UNSET):
+	    tmp = (attr->opt >= 0)?attr->opt:key;
+	    set_key_bit(tmp, 0);
+	    set_virt_bit(tmp, 1);
+	    if (log)
+		lprint_attr(ATTR_UNSET, tmp);
+	    NEXT;
+	ACTION(ATTR_REMAP):
+	    /* Applied before matching */
+	    NEXT;
+	ACTION(ATTR_MAX):
+	ACTION(ATTR_TIMEOUT):
+	    /* Applied when the command is started */
+	    NEXT;
+	ACTION(ATTR_END):
+	    flush_keys();
+	    return exec_ok;
+    }
+
+    return exec_ok;
+}
+
+
+/* Handle a single key event of the current device */
+static void handle_key(int key, int type, int noexec, int showexec, int showkey) {
     key_cmd *cmd;
+    int exec_ok = 0, norel = 0;
+
+    /* The device is in charge of the key again */
+    set_virt_bit(key, 0);
+    if ((type & (KEY | REP)) != 0)
+	set_key_bit(key, 1);
+
+    if (verbose > 2) {
+	lprintf("Event: ");
+	lprint_key_mask();
+	lprintf(":%s\n", (type == KEY)?"key":((type == REP)?"rep":"rel"));
+    }
+    if ((type == KEY) && showkey) {
+	lprintf("Keys: ");
+	lprint_key_mask();
+	lprintf("\n");
+    }
+
+    if (match_key(type, &cmd) == OK) {
+	exec_ok = run_attrs(cmd, key, noexec, showexec, &norel);
+
+	/* Fall back on command execution */
+	if ((!exec_ok) && ((cmd->attr_bits & BIT_ATTR_NOEXEC) == 0)) {
+	    ext_exec(cmd, noexec, showexec);
+	    exec_ok = 1;
+	}
+    }
+
+    if ((type == REL) && (!norel) && ((!kbd->ignrel) || (get_ign_bit(key) == 0)))
+	set_key_bit(key, 0);
+}
+
+
+/* Handle the key events of an input frame. A grabbed device is passed on to
+ * the virtual keyboard through the remap table, if there is one, a frame at a
+ * time */
+static void handle_frame(key_event *frame, int n, int noexec, int showexec, int showkey) {
+    int i, fwd;
+
+    fwd = kbd->grabbed && virtual_output() && (remap_frame(frame, &n) == OK);
+
+    for (i = 0; i < n; ++i) {
+	record_delay(frame[i].time);
+	if (fwd)
+	    snd_key(frame[i].key, frame[i].type);
+	handle_key(frame[i].key, frame[i].type, noexec, showexec, showkey);
+    }
+
+    if (fwd)
+	flush_keys();
+}
+
+
+int main(int argc, char **argv) {
+    int ret, i, n, src, signum, detect, hotplug, unplugged = 0;
+    key_event frame[FRAME_KEYS];
+    pthread_t reloader;
+    pthread_attr_t attr;
+    sigset_t sigs;
+    kbd_t *dev;
+    char *name;
 
     /* Options */
     int help = 0, noexec = 0, version = 0, showexec = 0, showkey = 0;
+    int compile = 0, all = 0, grab = 0, realtime = 0, prio = 0, uring = 0;
+    int forkserver = 0;
 
     struct option options[] = {
+	{ "all", no_argument, 0, 'a' },
 	{ "config", required_argument, 0, 'c' },
+	{ "compile", no_argument, 0, 'C' },
 	{ "daemon", no_argument, 0, 'D' },
 	{ "device", required_argument, 0, 'd' },
+	{ "forkserver", no_argument, 0, 'f' },
+	{ "grab", no_argument, 0, 'g' },
+	{ "cgroup", required_argument, 0, 'G' },
 	{ "help", no_argument, 0, 'h' },
+	{ "id", required_argument, 0, 'I' },
+	{ "maxcmds", required_argument, 0, 'm' },
 	{ "noexec", no_argument, 0, 'n' },
+	{ "name", required_argument, 0, 'N' },
 	{ "pidfile", required_argument, 0, 'p' },
+	{ "phys", required_argument, 0, 'P' },
 	{ "quiet", no_argument, 0, 'q' },
+	{ "realtime", optional_argument, 0, 'r' },
 	{ "verbose", optional_argument, 0, 'v' },
 	{ "version", no_argument, 0, 'V' },
 	{ "showexec", no_argument, 0, 'x' },
 	{ "showkey", no_argument, 0, 's' },
+	{ "uring", no_argument, 0, 'u' },
 	{ "syslog", no_argument, 0, 'l' },
 	{ 0, 0, 0, 0 }
     };
@@ -176,11 +593,14 @@ int main(int argc, char **argv) {
     while (1) {
 	int c, option_index = 0;
 
-	c = getopt_long (argc, argv, "c:Dd:hp:qnv::Vxsl", options, &option_index);
+	c = getopt_long (argc, argv, "ac:CDd:fgG:hI:m:N:p:P:qr::nv::Vxslu", options, &option_index);
 	if (c == -1)
 	    break;
 
 	switch (c) {
+	    case 'a':
+		all = 1;
+		break;
 	    case 'c':
 		if (optarg) {
 		    config = strdup(optarg);
@@ -189,12 +609,30 @@ int main(int argc, char **argv) {
 		    return USAGE;
 		}
 		break;
+	    case 'C':
+		compile = 1;
+		break;
 	    case 'D':
 		detach = 1;
 		break;
 	    case 'd':
 		if (optarg) {
-		    device = strdup(optarg);
+		    if (add_device(strdup(optarg)) != OK)
+			return MEMERR;
+		} else {
+		    usage();
+		    return USAGE;
+		}
+		break;
+	    case 'f':
+		forkserver = 1;
+		break;
+	    case 'g':
+		grab = 1;
+		break;
+	    case 'G':
+		if (optarg) {
+		    cgroup = strdup(optarg);
 		} else {
 		    usage();
 		    return USAGE;
@@ -203,9 +641,30 @@ int main(int argc, char **argv) {
 	    case 'h':
 		help = 1;
 		break;
+	    case 'I':
+		if ((optarg == NULL) ||
+			(sscanf(optarg, "%x:%x", &(devmatch.vendor), &(devmatch.product)) < 1)) {
+		    usage();
+		    return USAGE;
+		}
+		break;
+	    case 'm':
+		if ((optarg == NULL) || ((maxcmds = atoi(optarg)) < 1)) {
+		    usage();
+		    return USAGE;
+		}
+		break;
 	    case 'n':
 		noexec = 1;
 		break;
+	    case 'N':
+		if (optarg) {
+		    devmatch.name = strdup(optarg);
+		} else {
+		    usage();
+		    return USAGE;
+		}
+		break;
 	    case 'p':
 		if (optarg) {
 		    pidfile = strdup(optarg);
@@ -214,9 +673,27 @@ int main(int argc, char **argv) {
 		    return USAGE;
 		}
 		break;
+	    case 'P':
+		if (optarg) {
+		    devmatch.phys = strdup(optarg);
+		} else {
+		    usage();
+		    return USAGE;
+		}
+		break;
 	    case 'q':
 		quiet = 1;
 		break;
+	    case 'r':
+		realtime = 1;
+		if (optarg) {
+		    prio = atoi(optarg);
+		    if ((prio < 1) || (prio > 99)) {
+			usage();
+			return USAGE;
+		    }
+		}
+		break;
 	    case 'v':
 		if (optarg) {
 		    verbose = optarg[0] - '0';
@@ -240,6 +717,9 @@ int main(int argc, char **argv) {
 	    case 'l':
 		uselog = 1;
 		break;
+	    case 'u':
+		uring = 1;
+		break;
 	    default:
 		usage();
 		return USAGE;
@@ -273,7 +753,20 @@ int main(int argc, char **argv) {
 	uselog = 2;
     }
 
-    /* Initialise the keyboard */
+    /* Compile the configuration file - no keyboard is needed for that */
+    if (compile) {
+	maxkey = MASK_KEYS - 1;
+	return compile_config();
+    }
+
+    if (!noexec && ((ret = init_cmds()) != OK))
+	return ret;
+
+    /* The fork server is started while the process is still small */
+    if (forkserver && !noexec)
+	start_server();
+
+    /* Initialise the keyboards */
     if ((ret = init_dev()) != OK)
 	return ret;
 
@@ -281,19 +774,43 @@ int main(int argc, char **argv) {
     if ((ret = open_config()) != OK)
 	return ret;
 
-    if ((ret = init_key_mask()) != OK)
+    /* The configuration file decides which keyboards are detected */
+    detect = (devcnt == 0);
+    if (detect && ((ret = detect_dev(all)) != OK))
 	return ret;
 
-    if ((ret = init_ign_mask()) != OK)
+    if ((ret = init_loop(uring)) != OK)
 	return ret;
 
-    if ((ret = open_dev()) != OK)
+    if ((server_fd() >= 0) && ((ret = watch_server(server_fd())) != OK))
 	return ret;
 
+    if ((timer_fd() >= 0) && ((ret = watch_timer(timer_fd())) != OK))
+	return ret;
+
+    for (i = 0; i < devcnt; ++i)
+	if ((ret = open_dev(devices[i])) != OK)
+	    return ret;
+
+    /* The generated key events go to a virtual keyboard, if possible */
+    init_output();
+
+    /* Devices that are unplugged are attached again when they reappear */
+    hotplug = (watch_devices(detect, all) == OK);
+
     /* Verbosity levels over 2 make showkey redundant */
     if (verbose > 2)
 	showkey = 0;
 
+    /* Reporting the keys needs every key event */
+    allkeys = showkey || (verbose > 2);
+    for (kbd = kbds; kbd != NULL; kbd = kbd->next) {
+	set_filter();
+	resync_keys();
+	if (grab)
+	    grab_dev();
+    }
+
     if (detach) {
 	switch (daemon(0, 0))
 	{
@@ -303,136 +820,102 @@ int main(int argc, char **argv) {
     		lprintf("%s: fork() error: %s\n", argv[0], strerror(errno));
     		return FORKERR;
 	}
-	lprintf("actkbd %s launched for %s\n", VERSION, device);
+	if (devcnt == 1)
+	    lprintf("actkbd %s launched for %s\n", VERSION, devices[0]);
+	else
+	    lprintf("actkbd %s launched for %i devices\n", VERSION, devcnt);
     }
 
     if (pidfile != NULL)
 	if ((ret = write_pid()) != OK)
 	    return ret;
 
-    /* Setup the signal handlers */
-    signal(SIGHUP, on_hup);
-    signal(SIGTERM, on_term);
-
-    while (get_key(&key, &type) == OK) {
-	int tmp, exec_ok = 0, norel = 0;
-
-	if ((type & (KEY | REP)) != 0)
-	    set_key_bit(key, 1);
-
-	if (verbose > 2) {
-	    lprintf("Event: ");
-	    lprint_key_mask();
-	    lprintf(":%s\n", (type == KEY)?"key":((type == REP)?"rep":"rel"));
-	}
-	if ((type == KEY) && showkey) {
-	    lprintf("Keys: ");
-	    lprint_key_mask();
-	    lprintf("\n");
-	}
+    /* The signals are received through the event loop. They must be blocked
+     * before the reconfiguration thread is started, so that it inherits the
+     * signal mask */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    if ((ret = watch_signals(&sigs)) != OK)
+	return ret;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RELOAD_STACK);
+    ret = pthread_create(&reloader, &attr, reload_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+	lprintf("Error: could not start the reconfiguration thread\n");
+	return INTERR;
+    }
 
-	ret = match_key(type, &cmd);
-	if (ret == OK) {
-	    attr_t *attr;
-
-	    /* Attribute implementation */
-	    attr = cmd->attrs;
-	    while (attr != NULL) {
-		char *str, opt[32] = { '\0' };
-		int out_type = INVALID;
-		switch (attr->type) {
-		    case ATTR_EXEC:
-			str = "exec";
-			ext_exec(cmd->command, noexec, showexec);
-			exec_ok = 1;
-			break;
-		    case ATTR_GRAB:
-			str = "grab";
-			grab_dev();
-			break;
-		    case ATTR_UNGRAB:
-			str = "ungrab";
-			ungrab_dev();
-			break;
-		    case ATTR_IGNREL:
-			str = "ignrel";
-			copy_key_to_ign_mask();
-			ignrel = 1;
-			break;
-		    case ATTR_RCVREL:
-			str = "rcvrel";
-			ignrel = 0;
-			break;
-		    case ATTR_ALLREL:
-			str = "allrel";
-			clear_key_mask();
-			break;
-		    case ATTR_KEY:
-			str = "key";
-			out_type = KEY;
-			break;
-		    case ATTR_REL:
-			str = "rel";
-			out_type = REL;
-			break;
-		    case ATTR_REP:
-			str = "rep";
-			out_type = REP;
-			break;
-		    case ATTR_SET:
-			str = "set";
-			tmp = (int)(attr->opt);
-			if (tmp < 0)
-			    tmp = key;
-			if (tmp == key)
-			    norel = 1;
-			snprintf(opt, 32, "%i", tmp);
-			set_key_bit(tmp, 1);
-			break;
-		    case ATTR_UNSET:
-			str = "unset";
-			tmp = (((int)(attr->opt)) >= 0)?(int)(attr->opt):key;
-			snprintf(opt, 32, "%i", tmp);
-			set_key_bit(tmp, 0);
-			break;
-		    case ATTR_LEDON:
-			str = "ledon";
-			snprintf(opt, 32, "%i", (int)(attr->opt));
-			set_led((int)(attr->opt), 1);
-			break;
-		    case ATTR_LEDOFF:
-			str = "ledoff";
-			snprintf(opt, 32, "%i", (int)(attr->opt));
-			set_led((int)(attr->opt), 0);
-			break;
-		    default:
-			str = "unknown";
-			break;
+    /* Only the event loop thread runs with a real-time priority */
+    if (realtime)
+	set_realtime(prio);
+
+    while (wait_loop(&src, &dev, &signum) == OK) {
+	if (src == SRC_SIGNAL) {
+	    if (signum == SIGHUP)
+		request_reload();
+	    else if (signum == SIGUSR1)
+		report_stats();
+	    else if (signum == SIGCHLD)
+		reap_cmds();
+	    else
+		break;
+	} else if (src == SRC_WAKE) {
+	    /* Switch to a reloaded configuration, whose keys must not be
+	     * filtered out */
+	    if (update_config() == OK) {
+		for (kbd = kbds; kbd != NULL; kbd = kbd->next) {
+		    set_filter();
+		    resync_keys();
 		}
-
-		if (out_type != INVALID) {
-		    tmp = (((int)(attr->opt)) >= 0)?(int)(attr->opt):key;
-		    snprintf(opt, 32, "%i", tmp);
-		    snd_key(tmp, out_type);
+		if (verbose > 1)
+		    lprintf("Reconfiguration complete\n");
+	    }
+	} else if (src == SRC_SERVER) {
+	    server_events();
+	} else if (src == SRC_TIMER) {
+	    timer_events();
+	} else if (src == SRC_HOTPLUG) {
+	    while ((name = next_hotplug()) != NULL) {
+		if (open_dev(name) != OK)
+		    continue;
+		kbd = kbds;
+		set_filter();
+		resync_keys();
+		if (grab)
+		    grab_dev();
+		if ((verbose > 0) || detach)
+		    lprintf("Attached %s\n", name);
+	    }
+	} else {
+	    kbd = dev;
+	    do {
+		if ((ret = get_keys(frame, FRAME_KEYS, &n)) != OK) {
+		    if ((ret == DEVFAIL) && hotplug)
+			unplugged = 1;
+		    free_match(dev);
+		    close_dev(dev);
+		    break;
 		}
 
-		if ((verbose > 0) || showexec)
-		    lprintf("Attribute: %s(%s)\n", str, opt);
+		handle_frame(frame, n, noexec, showexec, showkey);
 
-		attr = attr->next;
-	    }
+		if (kbd->resync)
+		    resync_keys();
+	    } while (pending_keys());
 
-	    /* Fall back on command execution */
-	    if ((!exec_ok) && ((cmd->attr_bits & BIT_ATTR_NOEXEC) == 0)) {
-		ext_exec(cmd->command, noexec, showexec);
-		exec_ok = 1;
-	    }
+	    /* Keep waiting for unplugged devices */
+	    if ((kbds == NULL) && !unplugged)
+		break;
 	}
-
-	if ((type == REL) && (!norel) && ((!ignrel) || (get_ign_bit(key) == 0)))
-	    set_key_bit(key, 0);
     }
 
+    terminate();
+
     return OK;
 }
 
@@ -23,6 +23,7 @@
 #include <getopt.h>
 #include <syslog.h>
 #include <signal.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 
@@ -44,15 +45,12 @@ enum { OK, USAGE, MEMERR, HOSTFAIL, DEVFAIL, READERR, WRITEERR, EVERR, CONFERR,
 /* Verbosity level */
 extern int verbose;
 
+/* Daemon mode */
+extern int detach;
+
 /* Maximum number of keys */
 extern int maxkey;
 
-/* Device grab state */
-extern int grabbed;
-
-/* The device name */
-extern char *device;
-
 /* The configuration file name */
 extern char *config;
 
@@ -60,14 +58,84 @@ extern char *config;
 /* Logging function */
 int lprintf(const char *fmt, ...);
 
+
+/* Number of keys covered by a key mask - a multiple of 64 */
+#define MASK_KEYS	768
+#define MASK_WORDS	(MASK_KEYS / 64)
+
+/* The key mask type */
+typedef struct {
+    uint64_t w[MASK_WORDS];
+} keymask_t;
+
+
+/* Number of event delay histogram buckets - bucket i counts the delays
+ * below 2^i microseconds, the last one all longer delays */
+#define DELAY_BUCKETS	16
+
+/* The per-device state */
+typedef struct _kbd_t kbd_t;
+struct _kbd_t {
+    char *name;			/* The device name */
+    int fd;			/* The device file descriptor */
+    int polled;			/* The device can be waited for */
+    void *buf;			/* The event buffer */
+
+    int grabbed;		/* Device grab state */
+    int ignrel;			/* Ignore release events */
+    keymask_t keys;		/* The active key mask */
+    keymask_t ign;		/* The ignored key mask */
+    keymask_t virt;		/* The keys set or unset by the rules */
+    void *match;		/* The incremental matching state */
+
+    int resync;			/* The key state must be read again */
+    unsigned long overruns;	/* Number of event buffer overruns */
+    unsigned long resyncs;	/* Number of key state resynchronisations */
+    unsigned long fixed;	/* Number of keys corrected by them */
+
+    int clock;			/* The events carry monotonic timestamps */
+    unsigned long delays[DELAY_BUCKETS];	/* Event delay histogram */
+    uint64_t delaysum;		/* Total event delay (ns) */
+    uint64_t delaymax;		/* Maximum event delay (ns) */
+
+    kbd_t *next;
+};
+
+/* All open devices */
+extern kbd_t *kbds;
+
+/* The device whose events are being handled */
+extern kbd_t *kbd;
+
+/* The device names to use */
+extern char **devices;
+extern int devcnt;
+
+/* Add a device name to use */
+int add_device(char *name);
+
+
+/* Device match criteria for the auto-detection */
+typedef struct {
+    char *name;			/* Device name pattern */
+    char *phys;			/* Physical path pattern */
+    int vendor;			/* Vendor ID, or -1 */
+    int product;		/* Product ID, or -1 */
+} devmatch_t;
+
+extern devmatch_t devmatch;
+
 /* Device initialisation */
 int init_dev();
 
-/* Device open function */
-int open_dev();
+/* Keyboard auto-detection - adds the detected keyboards to the device names */
+int detect_dev(int all);
+
+/* Device open function - the new device is added to the device list */
+int open_dev(char *name);
 
-/* Device close function */
-int close_dev();
+/* Device close function - the device is removed from the device list */
+int close_dev(kbd_t *dev);
 
 /* Device grab function */
 int grab_dev();
@@ -75,54 +143,118 @@ int grab_dev();
 /* Device un-grab function */
 int ungrab_dev();
 
-/* Keyboard event receiver function */
-int get_key(int *key, int *type);
+/* A key event */
+typedef struct {
+    int key;			/* The key code */
+    int type;			/* The event type */
+    int64_t time;		/* The monotonic kernel timestamp (ns), or 0 */
+} key_event;
+
+/* Maximum number of key events handed over at once */
+#define FRAME_KEYS	64
 
-/* Send an event to the input layer */
+/* Keyboard event receiver function - fills in the key events of the next
+ * input frame */
+int get_keys(key_event *frame, int max, int *count);
+
+/* Output initialisation - creates a virtual keyboard where possible */
+int init_output();
+void close_output();
+
+/* Queue an event for the input layer */
 int snd_key(int key, int type);
 
+/* Send the queued events */
+int flush_keys();
+
+/* Check whether the events are sent to a virtual keyboard */
+int virtual_output();
+
 /* Set a keyboard LED */
 int set_led(int led, int on);
 
+/* Have the kernel only report the specified keys */
+int filter_dev(keymask_t *keys);
+
+/* Check for buffered events */
+int pending_keys();
+
+/* Read the actual key state, along with the keys that the device has */
+int get_key_state(keymask_t *state, keymask_t *avail);
+
+/* Watch for devices that are plugged in later on */
+int watch_devices(int detect, int all);
+
+/* Get the name of the next device to attach */
+char *next_hotplug();
+
+
+/* Event sources */
+#define SRC_DEV			0	/* A device has events */
+#define SRC_SIGNAL		1	/* A signal has arrived */
+#define SRC_WAKE		2	/* The event loop has been woken up */
+#define SRC_HOTPLUG		3	/* Devices may have been plugged in */
+#define SRC_SERVER		4	/* The fork server has reported */
+#define SRC_TIMER		5	/* A command has run out of time */
+
+/* Event loop initialisation - io_uring is used if requested and available */
+int init_loop(int uring);
+
+/* Receive signals through the event loop */
+int watch_signals(sigset_t *set);
+
+/* Receive the fork server reports through the event loop */
+int watch_server(int fd);
+
+/* Receive the command watchdog timer through the event loop */
+int watch_timer(int fd);
+
+/* Wait for the next event source */
+int wait_loop(int *src, kbd_t **dev, int *signum);
+
+/* Wake up the event loop from another thread */
+int wake_loop();
+
 
 /* Key mask handling */
-int get_masksize();
-int init_mask(unsigned char **mask);
-void free_mask(unsigned char **mask);
-int lprint_mask(unsigned char *mask);
-int strmask(unsigned char **mask, char *keys);
+void clear_mask(keymask_t *mask);
+int lprint_mask(keymask_t *mask);
+int strmask(keymask_t *mask, char *keys);
+unsigned int hash_mask(uint64_t *words, int n);
+int cnt_mask(keymask_t *mask);
+int next_mask_bit(keymask_t *mask, int bit);
+int find_mask(uint64_t *masks, int n, int words, uint64_t *ref);
 
 /* The active key mask */
-int init_key_mask();
-void free_key_mask();
 void clear_key_mask();
 int set_key_bit(int bit, int val);
 int get_key_bit(int bit);
-int cmp_key_mask(unsigned char *mask0, unsigned int attr);
+int cmp_key_mask(keymask_t *mask0, unsigned int attr);
+int cnt_key_mask(keymask_t *mask0);
+int sync_key_mask(keymask_t *state, keymask_t *avail);
 int lprint_key_mask_delim(char c);
 int lprint_key_mask();
-unsigned char *get_key_mask();
+keymask_t *get_key_mask();
 
 /* The ignored key mask */
-int init_ign_mask();
-void free_ign_mask();
 void clear_ign_mask();
 int set_ign_bit(int bit, int val);
 int get_ign_bit(int bit);
-int cmp_ign_mask(unsigned char *mask0, unsigned int attr);
+int cmp_ign_mask(keymask_t *mask0, unsigned int attr);
 int lprint_ign_mask_delim(char c);
 int lprint_ign_mask();
-unsigned char *get_ign_mask();
 void copy_key_to_ign_mask();
 
+/* The virtual key mask */
+int set_virt_bit(int bit, int val);
+
 
-/* The attribute node struct */
-typedef struct _attr_t attr_t;
-struct _attr_t {
+/* The compiled attribute struct. The attributes of each entry are kept in
+ * an array that is terminated by ATTR_END */
+typedef struct {
     int type;			/* Attribute type */
-    void *opt;			/* Options for this attribute */
-    attr_t *next;		/* The next node */
-};
+    int opt;			/* Attribute argument */
+} attr_t;
 
 /* Supported attributes */
 #define ATTR_EXEC		0
@@ -138,32 +270,94 @@ struct _attr_t {
 #define ATTR_LEDOFF		10
 #define ATTR_SET		11
 #define ATTR_UNSET		12
+#define ATTR_REMAP		13
+#define ATTR_MAX		14
+#define ATTR_TIMEOUT		15
+#define ATTR_END		16
 
 
 /* The key_cmd struct */
 typedef struct {
-    unsigned char *keys;	/* The key mask */
+    keymask_t keys;		/* The key mask */
     int type;			/* The event type */
     char *command;		/* The command to execute */
+    char *path;			/* The program, if executed without a shell */
+    char **argv;		/* Its arguments */
+    int maxrun;			/* Maximum number of running commands, or 0 */
+    int timeout;		/* Run time limit (ms), or 0 */
+    unsigned long runs;		/* Number of commands started */
+    int status;			/* Wait status of the last one to exit, or -1 */
 
     unsigned int attr_bits;	/* Bitwise attributes */
 
-    attr_t *attrs;		/* The attribute list */
+    attr_t *attrs;		/* The attribute array */
 } key_cmd;
 
 /* The bitwise attribute values */
-#define BIT_ATTR_NOEXEC		(1<<0)	/* Do not call system() */
+#define BIT_ATTR_NOEXEC		(1<<0)	/* Do not run the command */
 #define BIT_ATTR_GRABBED	(1<<1)	/* Match only when the device is grabbed */
 #define BIT_ATTR_UNGRABBED	(1<<2)	/* Match only when the device is not grabbed */
 #define BIT_ATTR_NOT		(1<<3)	/* Match any key except for the specified ones */
 #define BIT_ATTR_ALL		(1<<4)	/* Match if all of the specified keys is pressed */
 #define BIT_ATTR_ANY		(1<<5)	/* Match if any of the specified keys is pressed */
+#define BIT_ATTR_REMAP		(1<<6)	/* A remap table entry - never matched */
+#define BIT_ATTR_SINGLE		(1<<7)	/* Only run one command at a time */
+#define BIT_ATTR_COALESCE	(1<<8)	/* Run the command once more instead of dropping it */
 
 
 /* Configuration file processing */
 int open_config();
 int close_config();
 int match_key(int type, key_cmd **command);
+int compile_config();
+int reload_config();
+int update_config();
+void config_keys(keymask_t *keys);
+void config_used(keymask_t *keys);
+void free_match(kbd_t *dev);
+void update_match(int key, int val);
+int remap_frame(key_event *frame, int *count);
+int remap_mask(keymask_t *mask);
+
+
+/* Compiled configuration cache */
+typedef struct _cache_t cache_t;
+
+int write_cache(key_cmd **cmds, int count);
+int read_cache(cache_t **cache, key_cmd **cmds, int *count);
+void free_cache(cache_t *cache);
+
+
+/* Region allocator */
+typedef struct _arena_t arena_t;
+
+arena_t *new_arena();
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *str);
+void arena_stats(arena_t *arena, int *blocks, size_t *size);
+void free_arena(arena_t *arena);
+
+
+/* External command execution */
+extern int maxcmds;		/* Maximum number of running commands, or 0 */
+extern char *cgroup;		/* The cgroup to place the commands in */
+
+int init_cmds();
+int prepare_cmd(arena_t *arena, key_cmd *cmd);
+int spawn_cmd(key_cmd *cmd, int log);
+void reap_cmds();
+void release_cmds();
+void report_cmds();
+
+/* The command watchdog */
+int timer_fd();
+void timer_events();
+
+/* The fork server */
+int start_server();
+void stop_server();
+int server_fd();
+void server_events();
 
 
 #endif /* _ACTKBD_H_ */
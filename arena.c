@@ -0,0 +1,120 @@
+/*
+ * actkbd - A keyboard shortcut daemon
+ *
+ * Copyright (c) 2005-2006 Theodoros V. Kalamatianos <nyb@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#include "actkbd.h"
+
+
+/* Allocation alignment */
+#define ARENA_ALIGN	16
+
+/* Size of the first block */
+#define ARENA_BLOCK	4096
+
+
+/* The arena block header */
+typedef struct _arena_blk {
+    struct _arena_blk *next;	/* The previous (full) block */
+    size_t size;		/* Usable size */
+    size_t used;		/* Used size */
+} arena_blk;
+
+/* Keep the block data aligned */
+#define BLK_HDR		((sizeof(arena_blk) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
+struct _arena_t {
+    arena_blk *blk;		/* The current block */
+    size_t next;		/* Size of the next block */
+    size_t total;		/* Total size of all blocks */
+    int blocks;			/* Number of blocks */
+};
+
+
+arena_t *new_arena() {
+    arena_t *arena;
+
+    arena = (arena_t *)(calloc(1, sizeof(arena_t)));
+    if (arena == NULL)
+	return NULL;
+
+    arena->next = ARENA_BLOCK;
+
+    return arena;
+}
+
+
+/* Allocate zeroed memory from an arena */
+void *arena_alloc(arena_t *arena, size_t size) {
+    arena_blk *blk = arena->blk;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+
+    if ((blk == NULL) || (blk->size - blk->used < size)) {
+	size_t bsize = arena->next;
+
+	/* Double the block size each time, so that a rule set ends up in a
+	 * handful of blocks regardless of its size */
+	while (bsize < size)
+	    bsize *= 2;
+
+	blk = (arena_blk *)(calloc(1, BLK_HDR + bsize));
+	if (blk == NULL)
+	    return NULL;
+
+	blk->next = arena->blk;
+	blk->size = bsize;
+	blk->used = 0;
+	arena->blk = blk;
+	arena->next = bsize * 2;
+	arena->total += bsize;
+	++arena->blocks;
+    }
+
+    ptr = (char *)blk + BLK_HDR + blk->used;
+    blk->used += size;
+
+    return ptr;
+}
+
+
+char *arena_strdup(arena_t *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *dup;
+
+    dup = (char *)(arena_alloc(arena, len));
+    if (dup != NULL)
+	memcpy(dup, str, len);
+
+    return dup;
+}
+
+
+/* Report the arena usage */
+void arena_stats(arena_t *arena, int *blocks, size_t *size) {
+    *blocks = arena->blocks;
+    *size = arena->total;
+}
+
+
+void free_arena(arena_t *arena) {
+    arena_blk *blk, *tmp;
+
+    if (arena == NULL)
+	return;
+
+    blk = arena->blk;
+    while (blk != NULL) {
+	tmp = blk;
+	blk = blk->next;
+	free(tmp);
+    }
+
+    free(arena);
+}
@@ -0,0 +1,377 @@
+/*
+ * actkbd - A keyboard shortcut daemon
+ *
+ * Copyright (c) 2005-2006 Theodoros V. Kalamatianos <nyb@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#include "actkbd.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/*
+ * The compiled configuration image. All references are offsets from the
+ * start of the image, so that it can be mapped anywhere and shared between
+ * all actkbd instances that use the same configuration file.
+ */
+
+#define CACHE_SUFFIX	".bin"
+#define CACHE_MAGIC	"actkbd\0C"
+#define CACHE_VERSION	5
+
+typedef struct {
+    char magic[8];
+    uint32_t version;		/* The image format version */
+    uint32_t masksize;		/* sizeof(keymask_t) of the compiling binary */
+    int64_t mtime;		/* The source file modification time */
+    int64_t mtime_nsec;
+    int64_t size;		/* The source file size */
+    uint64_t checksum;		/* Checksum of everything after the header */
+    uint32_t rules;		/* Number of entries */
+    uint32_t attrs;		/* Number of attributes, terminators included */
+    uint32_t strings;		/* Size of the string table */
+    uint32_t reserved;
+} cache_hdr;
+
+typedef struct {
+    keymask_t keys;		/* The key mask */
+    int32_t type;		/* The event type */
+    uint32_t attr_bits;		/* Bitwise attributes */
+    uint32_t attr_first;	/* Index of the first attribute */
+    uint32_t attr_count;	/* Number of attributes, with the terminator */
+    uint32_t command;		/* String table offset of the command */
+    uint32_t reserved;
+} cache_rule;
+
+
+/* A loaded image - the attribute arrays and the commands are used in place */
+struct _cache_t {
+    void *image;		/* The mapping */
+    size_t size;
+    key_cmd *cmds;		/* The entry block */
+};
+
+
+static char *cache_name() {
+    static char *name = NULL;
+
+    if (name == NULL) {
+	name = (char *)(malloc(strlen(config) + strlen(CACHE_SUFFIX) + 1));
+	if (name == NULL)
+	    return NULL;
+	sprintf(name, "%s" CACHE_SUFFIX, config);
+    }
+
+    return name;
+}
+
+
+/* 64-bit FNV-1a */
+static uint64_t checksum(const unsigned char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+	hash = (hash ^ data[i]) * 1099511628211ull;
+
+    return hash;
+}
+
+
+int write_cache(key_cmd **cmds, int count) {
+    struct stat st;
+    cache_hdr *hdr;
+    cache_rule *rule;
+    attr_t *attr, *a;
+    char *name, *tmpname, *str;
+    unsigned char *buf;
+    size_t len, strsize = 0;
+    int i, fd, nattrs = 0, ret = OK;
+
+    name = cache_name();
+    if (name == NULL) {
+	lprintf("Error: memory allocation failed\n");
+	return MEMERR;
+    }
+
+    if (stat(config, &st) != 0) {
+	lprintf("Error: could not stat %s: %s\n", config, strerror(errno));
+	return CONFERR;
+    }
+
+    /* Calculate the image size */
+    for (i = 0; i < count; ++i) {
+	for (a = cmds[i]->attrs; a->type != ATTR_END; ++a)
+	    ++nattrs;
+	++nattrs;
+	strsize += strlen(cmds[i]->command) + 1;
+    }
+
+    len = sizeof(cache_hdr) + count * sizeof(cache_rule) +
+	nattrs * sizeof(attr_t) + strsize;
+    buf = (unsigned char *)(calloc(1, len));
+    if (buf == NULL) {
+	lprintf("Error: memory allocation failed\n");
+	return MEMERR;
+    }
+
+    hdr = (cache_hdr *)buf;
+    rule = (cache_rule *)(buf + sizeof(cache_hdr));
+    attr = (attr_t *)(rule + count);
+    str = (char *)(attr + nattrs);
+
+    memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->version = CACHE_VERSION;
+    hdr->masksize = sizeof(keymask_t);
+    hdr->mtime = st.st_mtim.tv_sec;
+    hdr->mtime_nsec = st.st_mtim.tv_nsec;
+    hdr->size = st.st_size;
+    hdr->rules = count;
+    hdr->attrs = nattrs;
+    hdr->strings = strsize;
+
+    /* Flatten the entries */
+    nattrs = 0;
+    strsize = 0;
+    for (i = 0; i < count; ++i) {
+	rule[i].keys = cmds[i]->keys;
+	rule[i].type = cmds[i]->type;
+	rule[i].attr_bits = cmds[i]->attr_bits;
+	rule[i].attr_first = nattrs;
+	a = cmds[i]->attrs;
+	do {
+	    attr[nattrs++] = *a;
+	} while ((a++)->type != ATTR_END);
+	rule[i].attr_count = nattrs - rule[i].attr_first;
+	rule[i].command = strsize;
+	strcpy(str + strsize, cmds[i]->command);
+	strsize += strlen(cmds[i]->command) + 1;
+    }
+
+    hdr->checksum = checksum(buf + sizeof(cache_hdr), len - sizeof(cache_hdr));
+
+    /* Write to a temporary file and rename it, so that running instances
+     * never see a partially written image */
+    tmpname = (char *)(malloc(strlen(name) + 8));
+    if (tmpname == NULL) {
+	lprintf("Error: memory allocation failed\n");
+	free(buf);
+	return MEMERR;
+    }
+    sprintf(tmpname, "%s.XXXXXX", name);
+
+    fd = mkstemp(tmpname);
+    if (fd < 0) {
+	lprintf("Error: could not create %s: %s\n", tmpname, strerror(errno));
+	ret = CONFERR;
+    } else {
+	if ((write(fd, buf, len) != (ssize_t)len) || (fchmod(fd, 0644) != 0) ||
+		(close(fd) != 0) || (rename(tmpname, name) != 0)) {
+	    lprintf("Error: could not write %s: %s\n", name, strerror(errno));
+	    unlink(tmpname);
+	    ret = CONFERR;
+	}
+    }
+
+    if ((ret == OK) && (verbose > 0))
+	lprintf("Compiled %i entries into %s\n", count, name);
+
+    free(tmpname);
+    free(buf);
+
+    return ret;
+}
+
+
+/* All known bitwise attributes */
+#define ATTR_BITS	(BIT_ATTR_NOEXEC | BIT_ATTR_GRABBED | BIT_ATTR_UNGRABBED | \
+			 BIT_ATTR_NOT | BIT_ATTR_ALL | BIT_ATTR_ANY | BIT_ATTR_REMAP | \
+			 BIT_ATTR_SINGLE | BIT_ATTR_COALESCE)
+
+
+/* Check an attribute argument, as the configuration parser would */
+static int check_attr(attr_t *attr) {
+    switch (attr->type) {
+	case ATTR_KEY:
+	case ATTR_REL:
+	case ATTR_REP:
+	case ATTR_SET:
+	case ATTR_UNSET:
+	    return (attr->opt >= -1) && (attr->opt < MASK_KEYS);
+	case ATTR_LEDON:
+	case ATTR_LEDOFF:
+	    return (attr->opt >= 0);
+	case ATTR_REMAP:
+	    return (attr->opt >= 0) && (attr->opt < MASK_KEYS);
+	case ATTR_MAX:
+	case ATTR_TIMEOUT:
+	    return (attr->opt >= 1);
+	default:
+	    return 1;
+    }
+}
+
+
+/* Validate the mapped image against the source file */
+static int check_cache(void *image, size_t imagesize, struct stat *st) {
+    cache_hdr *hdr = (cache_hdr *)image;
+    cache_rule *rule;
+    attr_t *attr;
+    size_t len;
+    uint32_t i, j;
+
+    if ((imagesize < sizeof(cache_hdr)) ||
+	    (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0) ||
+	    (hdr->version != CACHE_VERSION) ||
+	    (hdr->masksize != sizeof(keymask_t)))
+	return CONFERR;
+
+    if ((hdr->mtime != st->st_mtim.tv_sec) ||
+	    (hdr->mtime_nsec != st->st_mtim.tv_nsec) ||
+	    (hdr->size != st->st_size)) {
+	if (verbose > 1)
+	    lprintf("Compiled configuration is out of date\n");
+	return CONFERR;
+    }
+
+    len = sizeof(cache_hdr) + (size_t)(hdr->rules) * sizeof(cache_rule) +
+	(size_t)(hdr->attrs) * sizeof(attr_t) + hdr->strings;
+    if ((len != imagesize) ||
+	    (checksum((unsigned char *)image + sizeof(cache_hdr),
+		      len - sizeof(cache_hdr)) != hdr->checksum))
+	return CONFERR;
+
+    /* Never trust the offsets, the attribute types, which are used for
+     * dispatching, or anything else that the parser would have rejected */
+    rule = (cache_rule *)(hdr + 1);
+    attr = (attr_t *)(rule + hdr->rules);
+    for (i = 0; i < hdr->rules; ++i) {
+	if ((rule[i].attr_count == 0) ||
+		(rule[i].attr_first > hdr->attrs) ||
+		(rule[i].attr_count > hdr->attrs - rule[i].attr_first) ||
+		(rule[i].command >= hdr->strings) ||
+		((rule[i].type & ~(KEY | REP | REL)) != 0) ||
+		((rule[i].attr_bits & ~ATTR_BITS) != 0))
+	    return CONFERR;
+
+	/* Remap entries index the remap table with their single key */
+	if (((rule[i].attr_bits & BIT_ATTR_REMAP) != 0) && (cnt_mask(&(rule[i].keys)) != 1))
+	    return CONFERR;
+
+	for (j = 0; j < rule[i].attr_count; ++j)
+	    if ((attr[rule[i].attr_first + j].type < 0) ||
+		    (attr[rule[i].attr_first + j].type >= ATTR_END) ||
+		    !check_attr(&(attr[rule[i].attr_first + j])))
+		break;
+	if ((j != rule[i].attr_count - 1) ||
+		(attr[rule[i].attr_first + j].type != ATTR_END))
+	    return CONFERR;
+    }
+    if ((hdr->strings > 0) && (((char *)image)[imagesize - 1] != '\0'))
+	return CONFERR;
+
+    return OK;
+}
+
+
+int read_cache(cache_t **cache, key_cmd **cmds, int *count) {
+    struct stat st, cst;
+    cache_hdr *hdr;
+    cache_rule *rule;
+    attr_t *attr;
+    char *name, *str;
+    key_cmd *cmd;
+    void *image;
+    size_t imagesize;
+    uint32_t i;
+    int fd;
+
+    *cache = NULL;
+    *cmds = NULL;
+    *count = 0;
+
+    name = cache_name();
+    if ((name == NULL) || (stat(config, &st) != 0))
+	return CONFERR;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+	return CONFERR;
+
+    if ((fstat(fd, &cst) != 0) || (cst.st_size == 0)) {
+	close(fd);
+	return CONFERR;
+    }
+
+    imagesize = cst.st_size;
+    image = mmap(NULL, imagesize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+	return CONFERR;
+
+    if (check_cache(image, imagesize, &st) != OK) {
+	if (verbose > 0)
+	    lprintf("Warning: ignoring compiled configuration %s\n", name);
+	munmap(image, imagesize);
+	return CONFERR;
+    }
+
+    hdr = (cache_hdr *)image;
+    rule = (cache_rule *)(hdr + 1);
+    attr = (attr_t *)(rule + hdr->rules);
+    str = (char *)(attr + hdr->attrs);
+
+    /* Only the entries need to be allocated */
+    *cache = (cache_t *)(malloc(sizeof(cache_t)));
+    cmd = (key_cmd *)(malloc((hdr->rules + 1) * sizeof(key_cmd)));
+    if ((*cache == NULL) || (cmd == NULL)) {
+	lprintf("Error: memory allocation failed\n");
+	free(*cache);
+	free(cmd);
+	*cache = NULL;
+	munmap(image, imagesize);
+	return MEMERR;
+    }
+
+    for (i = 0; i < hdr->rules; ++i) {
+	cmd[i].keys = rule[i].keys;
+	cmd[i].type = rule[i].type;
+	cmd[i].attr_bits = rule[i].attr_bits;
+	cmd[i].command = str + rule[i].command;
+	cmd[i].path = NULL;
+	cmd[i].argv = NULL;
+	cmd[i].maxrun = 0;
+	cmd[i].timeout = 0;
+	cmd[i].runs = 0;
+	cmd[i].status = -1;
+	cmd[i].attrs = &(attr[rule[i].attr_first]);
+    }
+
+    if (verbose > 1)
+	lprintf("Using compiled configuration %s\n", name);
+
+    (*cache)->image = image;
+    (*cache)->size = imagesize;
+    (*cache)->cmds = cmd;
+
+    *cmds = cmd;
+    *count = hdr->rules;
+
+    return OK;
+}
+
+
+void free_cache(cache_t *cache) {
+    if (cache == NULL)
+	return;
+
+    free(cache->cmds);
+    munmap(cache->image, cache->size);
+    free(cache);
+}
@@ -30,13 +30,15 @@ static int strtolower(char *str) {
 }
 
 
-static int proc_config(int lineno, char *line, key_cmd **cmd) {
-    int i, l, f = 1, etype = INVALID, ret = CONFERR;
+/* Parse a configuration line into an entry, allocated from the arena. The
+ * caller provides a buffer of at least the line size for a copy of the line */
+static int proc_config(arena_t *arena, int lineno, char *line, char *buf, key_cmd **cmd) {
+    int i, l, f = 1, etype = INVALID, ret = CONFERR, nattrs = 0;
     char *event = NULL, *attrs = NULL, *command = NULL;
     char *dup = NULL, *err = NULL, *tmp = NULL;
-    unsigned char *keys;
+    keymask_t keys;
     unsigned int attr_bits = 0;
-    attr_t *attrlst = NULL, *attr = NULL, *attr_last = NULL;
+    attr_t *attrlst = NULL;
 
     l = strlen(line);
     for (i = 0; i <= l; ++i) {
@@ -60,14 +62,15 @@ static int proc_config(int lineno, char *line, key_cmd **cmd) {
 	}
     }
 
-    /* Keep a copy of the line */
-    dup = strdup(line);
-    if (dup == NULL) {
-	lprintf("Error: memory allocation failed\n");
-	ret = MEMERR;
+    /* Never true after the loop above, but it keeps the compiler happy */
+    if ((event == NULL) || (attrs == NULL) || (command == NULL)) {
+	err = "missing fields";
 	goto ERROR;
     }
 
+    /* Keep a copy of the line */
+    dup = (char *)(memcpy(buf, line, l + 1));
+
     /* Set the field boundaries */
     *(event - 1) = '\0';
     *(attrs - 1) = '\0';
@@ -103,11 +106,18 @@ static int proc_config(int lineno, char *line, key_cmd **cmd) {
 	goto ERROR;
     }
 
-    /* Set the attribute list */
+    /* Set the attribute array - there cannot be more attributes than half
+     * the size of the field, plus the terminator */
+    attrlst = (attr_t *)(arena_alloc(arena, (strlen(attrs) / 2 + 2) * sizeof(attr_t)));
+    if (attrlst == NULL) {
+	lprintf("Error: memory allocation failed\n");
+	ret = MEMERR;
+	goto ERROR;
+    }
+
     strtolower(attrs);
     while ((tmp = strsep(&attrs, ", \t")) != NULL) {
-	int type = -1;
-	void *opt = NULL;
+	int type = -1, opt = 0;
 	char *num = NULL;
 
 	if (strlen(tmp) == 0)
@@ -125,6 +135,10 @@ static int proc_config(int lineno, char *line, key_cmd **cmd) {
 	    attr_bits |= BIT_ATTR_ALL;
 	} else if (strcmp(tmp, "any") == 0) {
 	    attr_bits |= BIT_ATTR_ANY;
+	} else if (strcmp(tmp, "single") == 0) {
+	    attr_bits |= BIT_ATTR_SINGLE;
+	} else if (strcmp(tmp, "coalesce") == 0) {
+	    attr_bits |= BIT_ATTR_COALESCE;
 	} else if (strcmp(tmp, "exec") == 0) {
 	    type = ATTR_EXEC;
 	} else if (strcmp(tmp, "grab") == 0) {
@@ -165,6 +179,19 @@ static int proc_config(int lineno, char *line, key_cmd **cmd) {
 	    type = ATTR_LEDOFF;
 	    tmp += 7;
 	    num = (void *)1;
+	} else if (strncmp(tmp, "remap(", 6) == 0) {
+	    type = ATTR_REMAP;
+	    attr_bits |= BIT_ATTR_REMAP;
+	    tmp += 6;
+	    num = (void *)1;
+	} else if (strncmp(tmp, "max(", 4) == 0) {
+	    type = ATTR_MAX;
+	    tmp += 4;
+	    num = (void *)1;
+	} else if (strncmp(tmp, "timeout(", 8) == 0) {
+	    type = ATTR_TIMEOUT;
+	    tmp += 8;
+	    num = (void *)1;
 	} else {
 	    lprintf("Warning: unknown attribute %s\n", tmp);
 	}
@@ -174,13 +201,17 @@ static int proc_config(int lineno, char *line, key_cmd **cmd) {
 
 	    errno = 0;
 	    if (strlen(num) > 0) {
-		opt = (void *)((int)strtol(num, (char **)NULL, 10));
+		opt = (int)strtol(num, (char **)NULL, 10);
 	    } else {
-		opt = (void *)((int)(-1));
+		opt = -1;
 	    }
 
-	    if (((int)opt < 0) &&
-		    ((type == ATTR_LEDON) || (type == ATTR_LEDOFF)))
+	    if ((opt < 0) &&
+		    ((type == ATTR_LEDON) || (type == ATTR_LEDOFF) || (type == ATTR_REMAP)))
+		errno = EINVAL;
+	    if ((type == ATTR_REMAP) && (opt > maxkey))
+		errno = EINVAL;
+	    if (((type == ATTR_MAX) || (type == ATTR_TIMEOUT)) && (opt < 1))
 		errno = EINVAL;
 
 	    if (errno != 0) {
@@ -190,43 +221,45 @@ static int proc_config(int lineno, char *line, key_cmd **cmd) {
 	}
 
 	if (type != -1) {
-	    attr = (attr_t *)(malloc(sizeof(attr_t)));
-	    if (attr == NULL) {
-		lprintf("Error: memory allocation failed\n");
-		ret = MEMERR;
+	    attrlst[nattrs].type = type;
+	    attrlst[nattrs].opt = opt;
+	    ++nattrs;
+	}
+    }
+    attrlst[nattrs].type = ATTR_END;
+    attrlst[nattrs].opt = 0;
+
+    /* `single' already means max(1) */
+    if ((attr_bits & BIT_ATTR_SINGLE) != 0) {
+	for (i = 0; i < nattrs; ++i) {
+	    if (attrlst[i].type == ATTR_MAX) {
+		err = "conflicting single and max() attributes";
 		goto ERROR;
 	    }
+	}
+    }
 
-	    attr->type = type;
-	    attr->opt = opt;
-	    attr->next = NULL;
-
-	    if (attrlst == NULL) {
-		attrlst = attr;
-		attr_last = attr;
-	    } else {
-		attr_last->next = attr;
-		attr_last = attr;
-	    }
+    /* Remap entries translate a single key, whatever the event type */
+    if ((attr_bits & BIT_ATTR_REMAP) != 0) {
+	if (cnt_mask(&keys) != 1) {
+	    err = "remap entry without a single key";
+	    goto ERROR;
 	}
+	etype = INVALID;
     }
 
-    *cmd = (key_cmd *)(malloc(sizeof(key_cmd)));
-    if (*cmd == NULL) {
+    *cmd = (key_cmd *)(arena_alloc(arena, sizeof(key_cmd)));
+    if ((*cmd == NULL) || (((*cmd)->command = arena_strdup(arena, command)) == NULL)) {
 	lprintf("Error: memory allocation failed\n");
 	ret = MEMERR;
 	goto ERROR;
     } else {
 	(*cmd)->keys = keys;
 	(*cmd)->type = etype;
-	(*cmd)->command = strdup(command);
 	(*cmd)->attr_bits = attr_bits;
 	(*cmd)->attrs = attrlst;
     }
 
-    /* Destroy the line copy */
-    free(dup);
-
     return OK;
 
     /* Error handler */
@@ -238,29 +271,101 @@ ERROR:
 		(dup != NULL)?dup:line,
 		(((dup != NULL)?dup:line)[l - 1] == '\n')?'\0':'\n');
 
+    /* The attribute array stays in the arena until the rule set is freed */
     *cmd = NULL;
 
-    /* Free the attribute list */
-    while (attrlst != NULL) {
-	attr = attrlst;
-	attrlst = attrlst->next;
-	free(attr);
-    }
-
-    if (dup != NULL)
-	free(dup);
-
     return ret;
 }
 
 
-typedef struct _confentry {
-    key_cmd *cmd;
-    struct _confentry *next;
-} confentry;
-
-
-static confentry *list = NULL;
+/* Number of event type/grab state slots */
+#define SLOTS		6
+
+/* Per-slot partition of the entries, so that each event only visits the
+ * entries that can apply to its type and to the current grab state */
+typedef struct {
+    /* Hash index of the entries that require an exact key mask match */
+    unsigned int size;			/* Number of buckets */
+    int *start;				/* Bucket offsets, size + 1 of them */
+    int *rule;				/* Entry indices, in file order per bucket */
+    uint64_t *keys;			/* The dense entry key masks, contiguously */
+
+    /* The scan list entries, in file order */
+    int scancnt;
+    int *scan;				/* Scan list positions */
+    int notcnt;
+    int *notlst;			/* The `not' entries, as local positions */
+} slotidx;
+
+/* A complete rule set, shared by all devices. Once it has been installed,
+ * only the event loop touches it, so it needs no locking */
+typedef struct {
+    /* Everything below, apart from the entry pointer table, is allocated
+     * from the arena */
+    arena_t *arena;
+    unsigned int serial;		/* Identifies the rule set */
+
+    /* The compiled entry table - parallel arrays indexed by file order */
+    int rulecnt;
+    int rulemax;
+    key_cmd **rulecmd;			/* The parsed entries */
+    int *ruletype;			/* The event types */
+    unsigned int *ruleattr;		/* The bitwise attributes */
+    key_cmd *cachecmd;			/* The entries, if read from a cache */
+    cache_t *cache;
+
+    slotidx slots[SLOTS];
+
+    /* Dense key indices for the keys used by the entries - index 0 is shared
+     * by all other keys, so that an exact match still fails when one is
+     * pressed */
+    unsigned short densemap[MASK_KEYS];
+    int densewords;			/* The dense mask size in 64-bit words */
+
+    /* The entries that cannot be hashed (not/all/any), in file order */
+    int *scanlst;
+    int scancnt;
+
+    /* Incremental matching data for the scan list entries */
+    int *keycnt;			/* Number of keys in each entry mask */
+    int *slotpos;			/* Local position in each slot, or -1 */
+
+    /* Per-key posting lists of the scan list entries that use each key */
+    int poststart[MASK_KEYS + 1];
+    int *postlst;
+
+    /* The remap table, indexed by key code - NULL if there are no remap
+     * entries */
+    unsigned short *remap;
+} ruleset;
+
+/* The matching state of a device. It follows the active key mask of the
+ * device and belongs to a specific rule set */
+typedef struct {
+    unsigned int serial;		/* The rule set serial number */
+    uint64_t *dense;			/* The active key mask in dense form */
+    int othercnt;			/* Number of pressed unused keys */
+    int activecnt;			/* Number of pressed keys */
+    int *hitcnt;			/* Number of pressed keys per scan list entry */
+    uint64_t *live[SLOTS];		/* The all/any entries that match */
+
+    /* The last match result, valid while the active key masks are unchanged */
+    uint64_t gen[SLOTS];
+    int last[SLOTS];
+} matchstate;
+
+/* The rule set in use */
+static ruleset *rules = NULL;
+
+/* A newly loaded rule set, waiting for the event loop to pick it up */
+static ruleset *pending = NULL;
+
+/* Active key mask generation - changes whenever a bit flips on any device.
+ * It is wide enough to never wrap around onto a stale cached result */
+static uint64_t generation = 1;
+
+/* The last rule set serial number */
+static unsigned int serial = 0;
 
 
 static void print_etype(int type) {
@@ -312,9 +417,16 @@ static void print_attrs(key_cmd *cmd) {
 	lprintf("%sany", sep);
 	sep = ",";
     }
+    if ((cmd->attr_bits & BIT_ATTR_SINGLE) > 0) {
+	lprintf("%ssingle", sep);
+	sep = ",";
+    }
+    if ((cmd->attr_bits & BIT_ATTR_COALESCE) > 0) {
+	lprintf("%scoalesce", sep);
+	sep = ",";
+    }
 
-    attr = cmd->attrs;
-    while (attr != NULL) {
+    for (attr = cmd->attrs; attr->type != ATTR_END; ++attr) {
 	char *str = "";
 	char opt[32] = { '\0' };
 	switch (attr->type) {
@@ -337,48 +449,567 @@ static void print_attrs(key_cmd *cmd) {
 		str = "allrel";
 		break;
 	    case ATTR_KEY:
-		snprintf(opt, 32, "key(%i)", (int)(attr->opt));
+		snprintf(opt, 32, "key(%i)", attr->opt);
 		break;
 	    case ATTR_REL:
-		snprintf(opt, 32, "rel(%i)", (int)(attr->opt));
+		snprintf(opt, 32, "rel(%i)", attr->opt);
 		break;
 	    case ATTR_REP:
-		snprintf(opt, 32, "rep(%i)", (int)(attr->opt));
+		snprintf(opt, 32, "rep(%i)", attr->opt);
 		break;
 	    case ATTR_SET:
-		snprintf(opt, 32, "set(%i)", (int)(attr->opt));
+		snprintf(opt, 32, "set(%i)", attr->opt);
 		break;
 	    case ATTR_UNSET:
-		snprintf(opt, 32, "unset(%i)", (int)(attr->opt));
+		snprintf(opt, 32, "unset(%i)", attr->opt);
 		break;
 	    case ATTR_LEDON:
-		snprintf(opt, 32, "ledon(%i)", (int)(attr->opt));
+		snprintf(opt, 32, "ledon(%i)", attr->opt);
 		break;
 	    case ATTR_LEDOFF:
-		snprintf(opt, 32, "ledoff(%i)", (int)(attr->opt));
+		snprintf(opt, 32, "ledoff(%i)", attr->opt);
+		break;
+	    case ATTR_REMAP:
+		snprintf(opt, 32, "remap(%i)", attr->opt);
+		break;
+	    case ATTR_MAX:
+		snprintf(opt, 32, "max(%i)", attr->opt);
+		break;
+	    case ATTR_TIMEOUT:
+		snprintf(opt, 32, "timeout(%i)", attr->opt);
 		break;
 	    default:
 		str = "unknown";
 		break;
 	}
 	lprintf("%s%s%s", sep, str, opt);
-	attr = attr->next;
 	sep = ",";
     }
 }
 
 
-int open_config() {
-    FILE *fp = NULL;
-    char *line;
+/* Map a single event type and a grab state to a hash slot */
+static int type_slot(int type, int grab) {
+    int t;
+
+    switch (type) {
+	case KEY:
+	    t = 0;
+	    break;
+	case REP:
+	    t = 1;
+	    break;
+	default:
+	    t = 2;
+	    break;
+    }
+
+    return (t << 1) | (grab != 0);
+}
+
+
+/* Check the grab state restrictions of an entry against a slot */
+static int slot_ok(unsigned int attr, int slot) {
+    int grab = slot & 1;
+
+    return ((((attr & BIT_ATTR_GRABBED) == 0) || grab) &&
+	    (((attr & BIT_ATTR_UNGRABBED) == 0) || !grab));
+}
+
+
+/* Check whether an entry applies to a slot */
+static int applies(ruleset *rs, int r, int slot) {
+    return (((rs->ruletype[r] & (1 << (slot >> 1))) != 0) &&
+	    slot_ok(rs->ruleattr[r], slot));
+}
+
+
+/* Update the match state of a scan list entry from its counters */
+static void update_live(ruleset *rs, matchstate *ms, int i) {
+    unsigned int attr = rs->ruleattr[rs->scanlst[i]];
+    int on, s, p;
+
+    /* `not' entries depend on every key, so they are checked in match_key() */
+    if ((attr & BIT_ATTR_NOT) != 0)
+	return;
+
+    if ((attr & BIT_ATTR_ALL) != 0)
+	on = (ms->hitcnt[i] == rs->keycnt[i]);
+    else
+	on = (ms->hitcnt[i] > 0);
+
+    for (s = 0; s < SLOTS; ++s) {
+	uint64_t *live = ms->live[s];
+
+	if ((p = rs->slotpos[i * SLOTS + s]) < 0)
+	    continue;
+	if (on)
+	    live[p / 64] |= ((uint64_t)1) << (p % 64);
+	else
+	    live[p / 64] &= ~(((uint64_t)1) << (p % 64));
+    }
+}
+
+
+/* Convert a key mask to dense form */
+static void dense_mask(ruleset *rs, keymask_t *keys, uint64_t *out) {
+    int k, d;
+
+    memset(out, 0, rs->densewords * sizeof(uint64_t));
+    for (k = next_mask_bit(keys, 0); k >= 0; k = next_mask_bit(keys, k + 1)) {
+	d = rs->densemap[k];
+	out[d / 64] |= ((uint64_t)1) << (d % 64);
+    }
+}
+
+
+/* Assign a dense index to each key used by the entries */
+static int build_dense(ruleset *rs) {
+    keymask_t used;
+    int i, k, n = 1;
+
+    clear_mask(&used);
+    for (i = 0; i < rs->rulecnt; ++i)
+	if (rs->ruletype[i] != INVALID)
+	    for (k = 0; k < MASK_WORDS; ++k)
+		used.w[k] |= rs->rulecmd[i]->keys.w[k];
+
+    for (k = next_mask_bit(&used, 0); k >= 0; k = next_mask_bit(&used, k + 1))
+	rs->densemap[k] = n++;
+
+    /* Keep wide masks usable by the vector kernels of find_mask() */
+    rs->densewords = (n + 63) / 64;
+    if (rs->densewords > 2)
+	rs->densewords = (rs->densewords + 3) & ~3;
+
+    if (verbose > 1)
+	lprintf("Using %i distinct keys (%i mask words)\n", n - 1, rs->densewords);
+
+    return OK;
+}
+
+
+/* Recalculate the matching state from the active key mask */
+static void reset_match(ruleset *rs, matchstate *ms) {
+    keymask_t *keys = get_key_mask();
+    int i, k;
+
+    dense_mask(rs, keys, ms->dense);
+    ms->othercnt = 0;
+    for (k = next_mask_bit(keys, 0); k >= 0; k = next_mask_bit(keys, k + 1))
+	if (rs->densemap[k] == 0)
+	    ++ms->othercnt;
+
+    ms->activecnt = cnt_key_mask(NULL);
+    for (i = 0; i < rs->scancnt; ++i) {
+	ms->hitcnt[i] = cnt_key_mask(&(rs->rulecmd[rs->scanlst[i]]->keys));
+	update_live(rs, ms, i);
+    }
+
+    memset(ms->gen, 0, sizeof(ms->gen));
+}
+
+
+/* Get the matching state of the current device, setting it up again if the
+ * rule set has changed since it was last used. A new state already reflects
+ * the active key mask */
+static matchstate *get_match(ruleset *rs, int *fresh) {
+    matchstate *ms = (matchstate *)(kbd->match);
+    size_t size, live;
+    char *p;
+    int s;
+
+    *fresh = 0;
+    if ((ms != NULL) && (ms->serial == rs->serial))
+	return ms;
+
+    free(ms);
+    kbd->match = NULL;
+
+    /* The state is a single block */
+    live = (rs->scancnt / 64 + 1) * sizeof(uint64_t);
+    size = sizeof(matchstate) + rs->densewords * sizeof(uint64_t) +
+	SLOTS * live + (rs->scancnt + 1) * sizeof(int);
+    ms = (matchstate *)(calloc(1, size));
+    if (ms == NULL) {
+	lprintf("Error: memory allocation failed\n");
+	return NULL;
+    }
+
+    p = (char *)(ms + 1);
+    ms->dense = (uint64_t *)p;
+    p += rs->densewords * sizeof(uint64_t);
+    for (s = 0; s < SLOTS; ++s) {
+	ms->live[s] = (uint64_t *)p;
+	p += live;
+    }
+    ms->hitcnt = (int *)p;
+
+    ms->serial = rs->serial;
+    reset_match(rs, ms);
+
+    kbd->match = ms;
+    *fresh = 1;
+
+    return ms;
+}
+
+
+/* Free the matching state of a device */
+void free_match(kbd_t *dev) {
+    free(dev->match);
+    dev->match = NULL;
+}
+
+
+/* Build the posting lists and counters for the scan list entries */
+static int build_live(ruleset *rs) {
+    int i, k, s, n = 0, scancnt = rs->scancnt;
+
+    rs->keycnt = (int *)(arena_alloc(rs->arena, (scancnt + 1) * sizeof(int)));
+    rs->slotpos = (int *)(arena_alloc(rs->arena, (scancnt + 1) * SLOTS * sizeof(int)));
+    if ((rs->keycnt == NULL) || (rs->slotpos == NULL)) {
+	lprintf("Error: memory allocation failed\n");
+	return MEMERR;
+    }
+
+    /* Partition the scan list by slot */
+    for (s = 0; s < SLOTS; ++s) {
+	slotidx *sl = &(rs->slots[s]);
+
+	sl->scan = (int *)(arena_alloc(rs->arena, (scancnt + 1) * sizeof(int)));
+	sl->notlst = (int *)(arena_alloc(rs->arena, (scancnt + 1) * sizeof(int)));
+	if ((sl->scan == NULL) || (sl->notlst == NULL)) {
+	    lprintf("Error: memory allocation failed\n");
+	    return MEMERR;
+	}
+
+	for (i = 0; i < scancnt; ++i) {
+	    if (!applies(rs, rs->scanlst[i], s)) {
+		rs->slotpos[i * SLOTS + s] = -1;
+		continue;
+	    }
+	    if ((rs->ruleattr[rs->scanlst[i]] & BIT_ATTR_NOT) != 0)
+		sl->notlst[sl->notcnt++] = sl->scancnt;
+	    rs->slotpos[i * SLOTS + s] = sl->scancnt;
+	    sl->scan[sl->scancnt++] = i;
+	}
+    }
+
+    /* Count the entries that use each key */
+    for (i = 0; i < scancnt; ++i) {
+	keymask_t *keys = &(rs->rulecmd[rs->scanlst[i]]->keys);
+
+	rs->keycnt[i] = cnt_mask(keys);
+	n += rs->keycnt[i];
+	for (k = next_mask_bit(keys, 0); k >= 0; k = next_mask_bit(keys, k + 1))
+	    ++rs->poststart[k + 1];
+    }
+    for (k = 0; k < MASK_KEYS; ++k)
+	rs->poststart[k + 1] += rs->poststart[k];
+
+    /* Fill in the posting lists, each one in file order */
+    rs->postlst = (int *)(arena_alloc(rs->arena, (n + 1) * sizeof(int)));
+    if (rs->postlst == NULL) {
+	lprintf("Error: memory allocation failed\n");
+	return MEMERR;
+    }
+    for (i = 0; i < scancnt; ++i) {
+	keymask_t *keys = &(rs->rulecmd[rs->scanlst[i]]->keys);
+
+	for (k = next_mask_bit(keys, 0); k >= 0; k = next_mask_bit(keys, k + 1))
+	    rs->postlst[rs->poststart[k]++] = i;
+    }
+    for (k = MASK_KEYS; k > 0; --k)
+	rs->poststart[k] = rs->poststart[k - 1];
+    rs->poststart[0] = 0;
+
+    return OK;
+}
+
+
+/* Track a change of the active key mask of the current device */
+void update_match(int key, int val) {
+    ruleset *rs = rules;
+    matchstate *ms;
+    int i, d, fresh;
+
+    ++generation;
+
+    if (rs == NULL)
+	return;
+
+    ms = get_match(rs, &fresh);
+    if ((ms == NULL) || fresh)
+	return;
+
+    if (key < 0) {
+	reset_match(rs, ms);
+	return;
+    }
+
+    /* Keep the dense active key mask up to date */
+    if ((d = rs->densemap[key]) != 0) {
+	ms->dense[d / 64] ^= ((uint64_t)1) << (d % 64);
+    } else {
+	ms->othercnt += (val)?1:-1;
+	if (ms->othercnt > 0)
+	    ms->dense[0] |= 1;
+	else
+	    ms->dense[0] &= ~((uint64_t)1);
+    }
+
+    ms->activecnt += (val)?1:-1;
+    for (i = rs->poststart[key]; i < rs->poststart[key + 1]; ++i) {
+	ms->hitcnt[rs->postlst[i]] += (val)?1:-1;
+	update_live(rs, ms, rs->postlst[i]);
+    }
+}
+
+
+/* Build the hash index of a slot */
+static int build_exact(ruleset *rs, int slot, int count) {
+    slotidx *idx = &(rs->slots[slot]);
+    int words = rs->densewords;
+    uint64_t *keys;
+    unsigned int b;
+    int i, n = 0;
+
+    keys = (uint64_t *)(malloc(words * sizeof(uint64_t)));
+    if (keys == NULL)
+	goto ERROR;
+
+    idx->size = 16;
+    while (idx->size < (unsigned int)(count * 2))
+	idx->size <<= 1;
+
+    idx->start = (int *)(arena_alloc(rs->arena, (idx->size + 1) * sizeof(int)));
+    if (idx->start == NULL)
+	goto ERROR;
+
+    /* Count the entries in each bucket */
+    for (i = 0; i < rs->rulecnt; ++i) {
+	if (((rs->ruleattr[i] & (BIT_ATTR_NOT | BIT_ATTR_ALL | BIT_ATTR_ANY)) != 0) ||
+		!applies(rs, i, slot))
+	    continue;
+	dense_mask(rs, &(rs->rulecmd[i]->keys), keys);
+	b = hash_mask(keys, words) & (idx->size - 1);
+	++idx->start[b + 1];
+	++n;
+    }
+    for (b = 0; b < idx->size; ++b)
+	idx->start[b + 1] += idx->start[b];
+
+    idx->rule = (int *)(arena_alloc(rs->arena, (n + 1) * sizeof(int)));
+    idx->keys = (uint64_t *)(arena_alloc(rs->arena, (n + 1) * words * sizeof(uint64_t)));
+    if ((idx->rule == NULL) || (idx->keys == NULL))
+	goto ERROR;
+
+    /* Fill in the buckets, keeping the file order in each one */
+    for (i = 0; i < rs->rulecnt; ++i) {
+	if (((rs->ruleattr[i] & (BIT_ATTR_NOT | BIT_ATTR_ALL | BIT_ATTR_ANY)) != 0) ||
+		!applies(rs, i, slot))
+	    continue;
+	dense_mask(rs, &(rs->rulecmd[i]->keys), keys);
+	b = hash_mask(keys, words) & (idx->size - 1);
+	idx->rule[idx->start[b]] = i;
+	memcpy(idx->keys + idx->start[b] * words, keys, words * sizeof(uint64_t));
+	++idx->start[b];
+    }
+    for (b = idx->size; b > 0; --b)
+	idx->start[b] = idx->start[b - 1];
+    idx->start[0] = 0;
+
+    free(keys);
+
+    return OK;
+
+ERROR:
+    lprintf("Error: memory allocation failed\n");
+    free(keys);
+    return MEMERR;
+}
+
+
+/* Build the remap table. Later entries override earlier ones */
+static int build_remap(ruleset *rs) {
+    attr_t *attr;
+    int i, k, n = 0;
+
+    for (i = 0; i < rs->rulecnt; ++i) {
+	if ((rs->ruleattr[i] & BIT_ATTR_REMAP) == 0)
+	    continue;
+
+	if (rs->remap == NULL) {
+	    rs->remap = (unsigned short *)(arena_alloc(rs->arena, MASK_KEYS * sizeof(unsigned short)));
+	    if (rs->remap == NULL) {
+		lprintf("Error: memory allocation failed\n");
+		return MEMERR;
+	    }
+	    for (k = 0; k < MASK_KEYS; ++k)
+		rs->remap[k] = k;
+	}
+
+	k = next_mask_bit(&(rs->rulecmd[i]->keys), 0);
+	if (k < 0)
+	    continue;
+	for (attr = rs->rulecmd[i]->attrs; attr->type != ATTR_END; ++attr)
+	    if ((attr->type == ATTR_REMAP) && (attr->opt >= 0) && (attr->opt < MASK_KEYS))
+		rs->remap[k] = attr->opt;
+	++n;
+    }
+
+    if ((n > 0) && (verbose > 1))
+	lprintf("Remapping %i keys\n", n);
+
+    return OK;
+}
+
+
+/* Prepare the commands of the entries that execute one */
+static int build_exec(ruleset *rs) {
     key_cmd *cmd;
-    confentry *lastnode = NULL, *newnode = NULL;
-    int lineno = 1, ret = 0;
-    size_t n = 0;
+    attr_t *attr;
+    int i, n = 0, direct = 0;
 
-    /* Allow the configuration file to be overridden */
-    if (!config)
-	config = CONFIG;
+    for (i = 0; i < rs->rulecnt; ++i) {
+	cmd = rs->rulecmd[i];
+	if (cmd->type == INVALID)
+	    continue;
+	for (attr = cmd->attrs; attr->type != ATTR_END; ++attr)
+	    if (attr->type == ATTR_EXEC)
+		break;
+	if ((attr->type != ATTR_EXEC) && ((cmd->attr_bits & BIT_ATTR_NOEXEC) != 0))
+	    continue;
+
+	if (prepare_cmd(rs->arena, cmd) != OK) {
+	    lprintf("Error: memory allocation failed\n");
+	    return MEMERR;
+	}
+	++n;
+	if (cmd->path != NULL)
+	    ++direct;
+    }
+
+    if ((n > 0) && (verbose > 1))
+	lprintf("Executing %i of %i commands without a shell\n", direct, n);
+
+    return OK;
+}
+
+
+/* Build the compiled entry table, the hash indices and the scan list */
+static int build_index(ruleset *rs) {
+    int i, ret, count = rs->rulecnt;
+
+    rs->ruletype = (int *)(arena_alloc(rs->arena, (count + 1) * sizeof(int)));
+    rs->ruleattr = (unsigned int *)(arena_alloc(rs->arena, (count + 1) * sizeof(unsigned int)));
+    rs->scanlst = (int *)(arena_alloc(rs->arena, (count + 1) * sizeof(int)));
+    if ((rs->ruletype == NULL) || (rs->ruleattr == NULL) || (rs->scanlst == NULL)) {
+	lprintf("Error: memory allocation failed\n");
+	return MEMERR;
+    }
+
+    for (i = 0; i < count; ++i) {
+	rs->ruletype[i] = rs->rulecmd[i]->type;
+	rs->ruleattr[i] = rs->rulecmd[i]->attr_bits;
+
+	if ((rs->ruleattr[i] & (BIT_ATTR_NOT | BIT_ATTR_ALL | BIT_ATTR_ANY)) != 0)
+	    rs->scanlst[rs->scancnt++] = i;
+    }
+
+    if ((ret = build_remap(rs)) != OK)
+	return ret;
+
+    if ((ret = build_exec(rs)) != OK)
+	return ret;
+
+    if ((ret = build_dense(rs)) != OK)
+	return ret;
+
+    for (i = 0; i < SLOTS; ++i)
+	if ((ret = build_exact(rs, i, count - rs->scancnt)) != OK)
+	    return ret;
+
+    if (verbose > 1)
+	lprintf("Indexed %i entries, %i are matched incrementally\n",
+		count - rs->scancnt, rs->scancnt);
+
+    return build_live(rs);
+}
+
+
+/* Report a configuration entry */
+static void print_entry(key_cmd *cmd) {
+    lprintf("Config: ");
+    lprint_mask(&(cmd->keys));
+    lprintf(" -:- ");
+    print_etype(cmd->type);
+    lprintf(" -:- ");
+    print_attrs(cmd);
+    lprintf(" -:- %s\n", cmd->command);
+}
+
+
+/* Append an entry to the entry table */
+static int add_entry(ruleset *rs, key_cmd *cmd) {
+    if (rs->rulecnt == rs->rulemax) {
+	key_cmd **tmp;
+
+	rs->rulemax = (rs->rulemax > 0)?(rs->rulemax * 2):64;
+	tmp = (key_cmd **)(realloc(rs->rulecmd, rs->rulemax * sizeof(key_cmd *)));
+	if (tmp == NULL) {
+	    lprintf("Error: memory allocation failed\n");
+	    return MEMERR;
+	}
+	rs->rulecmd = tmp;
+    }
+
+    rs->rulecmd[rs->rulecnt++] = cmd;
+
+    return OK;
+}
+
+
+/* Create an empty rule set */
+static ruleset *new_rules() {
+    ruleset *rs;
+
+    rs = (ruleset *)(calloc(1, sizeof(ruleset)));
+    if (rs == NULL)
+	return NULL;
+
+    rs->arena = new_arena();
+    if (rs->arena == NULL) {
+	free(rs);
+	return NULL;
+    }
+
+    return rs;
+}
+
+
+/* Free a rule set */
+static void free_rules(ruleset *rs) {
+    if (rs == NULL)
+	return;
+
+    /* The parsed entries and the index all go away with the arena */
+    free_arena(rs->arena);
+    free_cache(rs->cache);
+    free(rs->rulecmd);
+
+    free(rs);
+}
+
+
+/* Parse the configuration file */
+static int read_config(ruleset *rs) {
+    FILE *fp = NULL;
+    char *line = NULL, *buf = NULL;
+    key_cmd *cmd;
+    int lineno = 1, ret = 0, err = OK;
+    size_t n = 0, bufsize = 0;
 
     fp = fopen(config, "r");
     if (fp == NULL) {
@@ -388,94 +1019,345 @@ int open_config() {
     if (verbose > 1)
 	lprintf("Using configuration file %s\n", config);
 
+    /* The line buffers are reused for all lines */
     while (!feof(fp) && (ret >=0)) {
-	line = NULL;
 	ret = getline(&line, &n, fp);
-	if ((ret > 0) && (proc_config(lineno, line, &cmd) == OK)) {
-	    newnode = (confentry *)(malloc(sizeof(confentry)));
-	    if (newnode == NULL) {
+	if ((ret > 0) && (bufsize < n)) {
+	    free(buf);
+	    bufsize = n;
+	    buf = (char *)(malloc(bufsize));
+	    if (buf == NULL) {
 		lprintf("Error: memory allocation failed\n");
-		close_config();
-		free(line);
-		return MEMERR;
-	    }
-
-	    newnode->cmd = cmd;
-	    newnode->next = NULL;
-
-	    if (list == NULL) {
-		list = newnode;
-	    } else {
-		lastnode->next = newnode;
+		err = MEMERR;
+		break;
 	    }
-	    lastnode = newnode;
-
-	    if (verbose > 1) {
-		lprintf("Config: ");
-		lprint_mask(cmd->keys);
-		lprintf(" -:- ");
-		print_etype(cmd->type);
-		lprintf(" -:- ");
-		print_attrs(cmd);
-		lprintf(" -:- %s\n", cmd->command);
+	}
+	if ((ret > 0) && (proc_config(rs->arena, lineno, line, buf, &cmd) == OK)) {
+	    if (add_entry(rs, cmd) != OK) {
+		err = MEMERR;
+		break;
 	    }
+
+	    if (verbose > 1)
+		print_entry(cmd);
 	}
-	free(line);
 	++lineno;
     }
 
+    free(buf);
+    free(line);
     fclose(fp);
 
+    return err;
+}
+
+
+/* Load the configuration into a new rule set */
+static int load_rules(ruleset **out) {
+    ruleset *rs;
+    key_cmd *cmds;
+    int i, ret, count;
+
+    *out = NULL;
+
+    /* Allow the configuration file to be overridden */
+    if (!config)
+	config = CONFIG;
+
+    rs = new_rules();
+    if (rs == NULL) {
+	lprintf("Error: memory allocation failed\n");
+	return MEMERR;
+    }
+    rs->serial = ++serial;
+
+    /* Prefer an up-to-date compiled configuration */
+    if (read_cache(&(rs->cache), &cmds, &count) == OK) {
+	for (i = 0; i < count; ++i) {
+	    if (add_entry(rs, &(cmds[i])) != OK) {
+		free_rules(rs);
+		return MEMERR;
+	    }
+	    if (verbose > 1)
+		print_entry(&(cmds[i]));
+	}
+    } else if ((ret = read_config(rs)) != OK) {
+	free_rules(rs);
+	return ret;
+    }
+
+    if ((ret = build_index(rs)) != OK) {
+	free_rules(rs);
+	return ret;
+    }
+
+    if (verbose > 1) {
+	int blocks;
+	size_t size;
+
+	arena_stats(rs->arena, &blocks, &size);
+	lprintf("Using %i memory blocks (%lu bytes) for the rule set\n", blocks,
+		(unsigned long)size);
+    }
+
+    *out = rs;
+
     return OK;
 }
 
 
-int close_config() {
-    confentry *node = list;
-    void *tmp;
-    attr_t *attr;
+/* Find the keys that can affect matching with a rule set */
+static void rule_keys(ruleset *rs, keymask_t *keys) {
+    int i, k;
 
-    while (node != NULL) {
-	free_mask(&(node->cmd->keys));
-	free(node->cmd->command);
+    clear_mask(keys);
+    if (rs == NULL)
+	return;
 
-	/* Free the attribute list */
-	attr = node->cmd->attrs;
-	while (attr != NULL) {
-	    tmp = attr;
-	    attr = attr->next;
-	    free(tmp);
+    for (i = 0; i < rs->rulecnt; ++i) {
+	/* Exact and `not' entries depend on every key that is pressed */
+	if (((rs->ruleattr[i] & BIT_ATTR_NOT) != 0) ||
+		((rs->ruleattr[i] & (BIT_ATTR_ALL | BIT_ATTR_ANY)) == 0)) {
+	    memset(keys, 0xff, sizeof(keymask_t));
+	    return;
 	}
 
-	free(node->cmd);
-	tmp = node->next;
-	free(node);
-	node = tmp;
+	for (k = 0; k < MASK_WORDS; ++k)
+	    keys->w[k] |= rs->rulecmd[i]->keys.w[k];
     }
-    list = NULL;
+}
+
+
+/* Make a rule set the active one. The devices set up their matching state
+ * for it from their key masks the next time they need it */
+static void install_rules(ruleset *rs) {
+    ruleset *old = rules;
+
+    rules = rs;
+    ++generation;
+
+    /* The event loop is the only reader, so nothing else can be using it -
+     * apart from the commands that are still running */
+    release_cmds();
+    free_rules(old);
+}
+
+
+int open_config() {
+    ruleset *rs;
+    int ret;
+
+    if ((ret = load_rules(&rs)) != OK)
+	return ret;
+
+    install_rules(rs);
 
     return OK;
 }
 
 
+int close_config() {
+    free_rules(rules);
+    rules = NULL;
+
+    free_rules(__atomic_exchange_n(&pending, NULL, __ATOMIC_ACQ_REL));
+
+    return OK;
+}
+
+
+/* Load the configuration in the background and publish it. This is called
+ * outside of the event loop, so that events keep being handled with the old
+ * rule set in the meantime */
+int reload_config() {
+    ruleset *rs;
+    int ret;
+
+    if ((ret = load_rules(&rs)) != OK) {
+	lprintf("Warning: keeping the old configuration\n");
+	return ret;
+    }
+
+    /* A rule set that was never picked up is simply superseded */
+    free_rules(__atomic_exchange_n(&pending, rs, __ATOMIC_ACQ_REL));
+
+    return OK;
+}
+
+
+/* Switch to a newly published rule set, if there is one */
+int update_config() {
+    ruleset *rs;
+
+    if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == NULL)
+	return NOMATCH;
+
+    rs = __atomic_exchange_n(&pending, NULL, __ATOMIC_ACQ_REL);
+    if (rs == NULL)
+	return NOMATCH;
+
+    install_rules(rs);
+
+    return OK;
+}
+
+
+/* Report the keys that can affect matching with the rule set in use */
+void config_keys(keymask_t *keys) {
+    rule_keys(rules, keys);
+}
+
+
+/* Report all keys that appear in the rule set in use */
+void config_used(keymask_t *keys) {
+    ruleset *rs = rules;
+    int i, k;
+
+    clear_mask(keys);
+    if (rs == NULL)
+	return;
+
+    for (i = 0; i < rs->rulecnt; ++i)
+	for (k = 0; k < MASK_WORDS; ++k)
+	    keys->w[k] |= rs->rulecmd[i]->keys.w[k];
+}
+
+
+/* Compile the configuration file into a binary cache */
+int compile_config() {
+    ruleset *rs;
+    int ret;
+
+    if (!config)
+	config = CONFIG;
+
+    if (access(config, R_OK) != 0) {
+	lprintf("Error: could not read the configuration file %s: %s\n", config, strerror(errno));
+	return CONFERR;
+    }
+
+    rs = new_rules();
+    if (rs == NULL) {
+	lprintf("Error: memory allocation failed\n");
+	return MEMERR;
+    }
+
+    if ((ret = read_config(rs)) == OK)
+	ret = write_cache(rs->rulecmd, rs->rulecnt);
+
+    free_rules(rs);
+
+    return ret;
+}
+
+
+/* Translate the keys of an input frame through the remap table, dropping the
+ * events of the keys that are mapped to 0 */
+int remap_frame(key_event *frame, int *count) {
+    unsigned short *remap = (rules != NULL)?rules->remap:NULL;
+    int i, k, n = 0;
+
+    if (remap == NULL)
+	return NOMATCH;
+
+    for (i = 0; i < *count; ++i) {
+	k = remap[frame[i].key];
+	if (k == 0)
+	    continue;
+	frame[n].key = k;
+	frame[n].type = frame[i].type;
+	frame[n].time = frame[i].time;
+	++n;
+    }
+    *count = n;
+
+    return OK;
+}
+
+
+/* Translate a key mask through the remap table, like remap_frame() */
+int remap_mask(keymask_t *mask) {
+    unsigned short *remap = (rules != NULL)?rules->remap:NULL;
+    keymask_t tmp;
+    int k;
+
+    if (remap == NULL)
+	return NOMATCH;
+
+    tmp = *mask;
+    clear_mask(mask);
+    for (k = next_mask_bit(&tmp, 0); k >= 0; k = next_mask_bit(&tmp, k + 1))
+	if (remap[k] != 0)
+	    mask->w[remap[k] / 64] |= (uint64_t)1 << (remap[k] % 64);
+
+    return OK;
+}
+
+
+/* Find the first entry that matches an event of the current device */
 int match_key(int type, key_cmd **command) {
-    confentry *node = list;
+    ruleset *rs = rules;
+    matchstate *ms;
+    slotidx *sl;
+    uint64_t *live;
+    unsigned int b;
+    int i, n, r, s, best, fresh;
 
     *command = NULL;
 
-    while (node != NULL) {
-	if (((node->cmd->type & type) == 0) ||
-		(((node->cmd->attr_bits & BIT_ATTR_GRABBED) > 0) && (!grabbed)) ||
-		(((node->cmd->attr_bits & BIT_ATTR_UNGRABBED) > 0) && (grabbed))) {
-	    node = node->next;
-	    continue;
+    if (rs == NULL)
+	return NOMATCH;
+
+    ms = get_match(rs, &fresh);
+    if (ms == NULL)
+	return NOMATCH;
+
+    s = type_slot(type, kbd->grabbed);
+    sl = &(rs->slots[s]);
+    live = ms->live[s];
+
+    /* Repeat events usually leave the key mask unchanged */
+    if (ms->gen[s] == generation) {
+	best = ms->last[s];
+	goto DONE;
+    }
+
+    /* Look up the first exact-match entry for the active key mask */
+    b = hash_mask(ms->dense, rs->densewords) & (sl->size - 1);
+    n = find_mask(sl->keys + sl->start[b] * rs->densewords,
+	    sl->start[b + 1] - sl->start[b], rs->densewords, ms->dense);
+    best = (n >= 0)?sl->rule[sl->start[b] + n]:rs->rulecnt;
+
+    /* Check whether the first matching all/any entry precedes it */
+    for (i = 0; i <= sl->scancnt / 64; ++i) {
+	if (live[i] != 0) {
+	    r = rs->scanlst[sl->scan[i * 64 + __builtin_ctzll(live[i])]];
+	    if (r < best)
+		best = r;
+	    break;
 	}
-	if (cmp_key_mask(node->cmd->keys, node->cmd->attr_bits)) {
-	    *command = node->cmd;
-	    return OK;
+    }
+
+    /* A `not' entry matches if a key outside of its mask is pressed */
+    for (i = 0; i < sl->notcnt; ++i) {
+	n = sl->scan[sl->notlst[i]];
+	r = rs->scanlst[n];
+
+	if (r > best)
+	    break;
+	if (ms->activecnt > ms->hitcnt[n]) {
+	    best = r;
+	    break;
 	}
-	node = node->next;
     }
 
-    return NOMATCH;
+    ms->gen[s] = generation;
+    ms->last[s] = best;
+
+DONE:
+    if (best >= rs->rulecnt)
+	return NOMATCH;
+
+    *command = rs->rulecmd[best];
+    return OK;
 }
@@ -0,0 +1,903 @@
+/*
+ * actkbd - A keyboard shortcut daemon
+ *
+ * Copyright (c) 2005-2006 Theodoros V. Kalamatianos <nyb@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#include "actkbd.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+
+/*
+ * External command execution. The commands are started without waiting for
+ * them, so that a slow command never holds up the event loop, and they are
+ * reaped when SIGCHLD arrives through the event loop. Simple commands are
+ * executed directly, without a shell. Optionally the commands are handed to
+ * a fork server, which reports back when they start and exit. Each command
+ * runs in a process group of its own, so that a command that runs out of
+ * time can be killed along with everything that it has started.
+ */
+
+#define SHELL		"/bin/sh"
+
+/* Characters that only the shell can make sense of */
+#define SHELL_CHARS	"|&;<>()$`\\\"'*?[]#~={}!\n"
+
+/* Words that are not programs - the shell keywords and the builtins that
+ * change the state of the shell itself */
+static const char *shell_words[] = {
+    "!", ".", ":", "[[", "alias", "break", "case", "cd", "continue", "do",
+    "done", "elif", "else", "esac", "eval", "exec", "exit", "export", "fi",
+    "for", "if", "in", "read", "readonly", "return", "set", "shift", "source",
+    "then", "times", "trap", "ulimit", "umask", "unalias", "unset", "until",
+    "wait", "while", NULL
+};
+
+/* Maximum number of running commands, or 0 */
+int maxcmds = 0;
+
+/* The cgroup to place the commands in, or NULL */
+char *cgroup = NULL;
+
+/* A running command */
+typedef struct {
+    pid_t pid;			/* The process ID, 0 until the server reports it */
+    uint32_t tag;		/* The fork server request, or 0 */
+    key_cmd *rule;		/* The entry, while its rule set is in use */
+    char *cmd;			/* The command, for reporting */
+    int64_t start;		/* When it was started (ms) */
+    int64_t deadline;		/* When it is to be killed (ms), or 0 */
+    int killed;			/* It has been killed */
+} child_t;
+
+static child_t *children = NULL;
+static int childcnt = 0, childmax = 0;
+
+/* The command statistics */
+static struct {
+    unsigned long started;	/* Commands started */
+    unsigned long failed;	/* Commands that could not start, or failed */
+    unsigned long killed;	/* Commands that ran out of time */
+    unsigned long dropped;	/* Requests dropped because of the limits */
+} stats;
+
+/* The watchdog timer, and the cgroup.procs file of the cgroup */
+static int timerfd = -1;
+static int cgfd = -1;
+
+/* The entries that are to run their command once more, when one of their
+ * running commands exits */
+static key_cmd **queued = NULL;
+static int queuecnt = 0, queuemax = 0;
+
+/* The entries that have started a command, for the statistics */
+static key_cmd **ran = NULL;
+static int rancnt = 0, ranmax = 0;
+
+/* The spawn attributes - the children must not inherit the blocked signals
+ * of the event loop */
+static posix_spawnattr_t spawnattr;
+static int spawninit = 0;
+
+/* Maximum size of a fork server message */
+#define SRV_MSG		4096
+
+/* A fork server request, followed by the program and the argument strings */
+typedef struct {
+    uint32_t tag;		/* Identifies the command */
+    uint32_t argc;		/* Number of arguments */
+} srv_req;
+
+/* A fork server report */
+typedef struct {
+    uint32_t tag;
+    int32_t event;		/* What happened to the command */
+    int32_t pid;
+    int32_t status;		/* The wait status, or the error number */
+} srv_rep;
+
+#define SRV_STARTED	0
+#define SRV_FAILED	1
+#define SRV_EXITED	2
+
+/* The connection to the fork server */
+static int srvfd = -1;
+static uint32_t srvtag = 0;
+static time_t srvstart = 0;		/* When it was last started */
+
+
+static int init_spawn() {
+    sigset_t none;
+
+    sigemptyset(&none);
+    if ((posix_spawnattr_init(&spawnattr) != 0) ||
+	    (posix_spawnattr_setsigmask(&spawnattr, &none) != 0) ||
+	    (posix_spawnattr_setpgroup(&spawnattr, 0) != 0) ||
+	    (posix_spawnattr_setflags(&spawnattr,
+				      POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP) != 0))
+	return INTERR;
+
+    spawninit = 1;
+
+    return OK;
+}
+
+
+static int64_t now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Set up the command watchdog and open the cgroup */
+int init_cmds() {
+    char *name;
+
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd < 0) {
+	lprintf("Error: could not create the command timer: %s\n", strerror(errno));
+	return INTERR;
+    }
+
+    if (cgroup == NULL)
+	return OK;
+
+    name = (char *)(malloc(strlen(cgroup) + sizeof("/cgroup.procs")));
+    if (name == NULL) {
+	lprintf("Error: memory allocation failed\n");
+	return MEMERR;
+    }
+    sprintf(name, "%s/cgroup.procs", cgroup);
+
+    cgfd = open(name, O_WRONLY | O_CLOEXEC);
+    if (cgfd < 0) {
+	lprintf("Error: could not open %s: %s\n", name, strerror(errno));
+	free(name);
+	return CONFERR;
+    }
+    free(name);
+
+    return OK;
+}
+
+
+/* Move a process into the cgroup. Anything that it has started already
+ * stays where it is */
+static void join_cgroup(pid_t pid) {
+    char str[16];
+    int len;
+
+    if (cgfd < 0)
+	return;
+
+    len = sprintf(str, "%i", pid);
+    if ((write(cgfd, str, len) != len) && (verbose > 0))
+	lprintf("Warning: could not move process %i to %s: %s\n", pid, cgroup, strerror(errno));
+}
+
+
+static int is_prog(char *path) {
+    struct stat st;
+
+    return (access(path, X_OK) == 0) && (stat(path, &st) == 0) && S_ISREG(st.st_mode);
+}
+
+
+/* Find an executable in the PATH */
+static char *find_path(arena_t *arena, char *name) {
+    char path[PATH_MAX], *env, *dir, *end;
+    size_t len;
+
+    /* Relative paths are left to the shell, as they depend on the directory
+     * that the command is run in, which changes when actkbd detaches */
+    if (strchr(name, '/') != NULL)
+	return ((name[0] == '/') && is_prog(name))?name:NULL;
+
+    env = getenv("PATH");
+    if (env == NULL)
+	env = "/usr/local/bin:/usr/bin:/bin";
+
+    for (dir = env; ; dir = end + 1) {
+	end = strchrnul(dir, ':');
+	len = end - dir;
+
+	/* An empty entry stands for the current directory */
+	if (len + strlen(name) + 2 <= sizeof(path)) {
+	    sprintf(path, "%.*s%s%s", (int)len, dir, (len > 0)?"/":"", name);
+	    if (is_prog(path))
+		return arena_strdup(arena, path);
+	}
+
+	if (*end == '\0')
+	    return NULL;
+    }
+}
+
+
+/* Prepare the direct execution of a command, if it needs no shell. The
+ * command is split into words and its program is looked up, once, with
+ * everything allocated from the rule set arena */
+int prepare_cmd(arena_t *arena, key_cmd *cmd) {
+    char *str, *word, *save, **argv;
+    attr_t *attr;
+    int i, n = 0;
+
+    cmd->path = NULL;
+    cmd->argv = NULL;
+
+    /* The concurrency limit - `single' and `coalesce' imply one command */
+    cmd->runs = 0;
+    cmd->status = -1;
+    cmd->maxrun = ((cmd->attr_bits & (BIT_ATTR_SINGLE | BIT_ATTR_COALESCE)) != 0)?1:0;
+    cmd->timeout = 0;
+    for (attr = cmd->attrs; attr->type != ATTR_END; ++attr) {
+	if (attr->type == ATTR_MAX)
+	    cmd->maxrun = attr->opt;
+	else if (attr->type == ATTR_TIMEOUT)
+	    cmd->timeout = attr->opt;
+    }
+
+    if ((cmd->command == NULL) || (strpbrk(cmd->command, SHELL_CHARS) != NULL))
+	return OK;
+
+    str = arena_strdup(arena, cmd->command);
+    argv = (char **)(arena_alloc(arena, (strlen(str) / 2 + 2) * sizeof(char *)));
+    if ((str == NULL) || (argv == NULL))
+	return MEMERR;
+
+    for (word = strtok_r(str, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save))
+	argv[n++] = word;
+    argv[n] = NULL;
+    if (n == 0)
+	return OK;
+
+    for (i = 0; shell_words[i] != NULL; ++i)
+	if (strcmp(argv[0], shell_words[i]) == 0)
+	    return OK;
+
+    /* Leave the commands that cannot be found to the shell, which also
+     * reports them */
+    cmd->path = find_path(arena, argv[0]);
+    if (cmd->path != NULL)
+	cmd->argv = argv;
+
+    return OK;
+}
+
+
+/* Find a free child table entry */
+static child_t *new_child() {
+    child_t *tmp;
+
+    if (childcnt == childmax) {
+	tmp = (child_t *)(realloc(children, (childmax + 16) * sizeof(child_t)));
+	if (tmp == NULL) {
+	    lprintf("Error: memory allocation failed\n");
+	    return NULL;
+	}
+	children = tmp;
+	childmax += 16;
+    }
+
+    return &(children[childcnt++]);
+}
+
+
+static void init_child(child_t *child, key_cmd *cmd, pid_t pid, uint32_t tag) {
+    child->pid = pid;
+    child->tag = tag;
+    child->rule = cmd;
+    child->cmd = strdup(cmd->command);
+    child->start = now_ms();
+    child->deadline = (cmd->timeout > 0)?(child->start + cmd->timeout):0;
+    child->killed = 0;
+}
+
+
+/* Count a command that has been started against its entry */
+static void count_run(key_cmd *cmd) {
+    key_cmd **tmp;
+
+    ++stats.started;
+    if ((cmd == NULL) || (cmd->runs++ > 0))
+	return;
+
+    if (rancnt == ranmax) {
+	tmp = (key_cmd **)(realloc(ran, (ranmax + 16) * sizeof(key_cmd *)));
+	if (tmp == NULL)
+	    return;
+	ran = tmp;
+	ranmax += 16;
+    }
+    ran[rancnt++] = cmd;
+}
+
+
+/* Have the watchdog timer expire when the next command runs out of time.
+ * The commands of the fork server are timed once it has reported them */
+static void arm_timer() {
+    struct itimerspec its;
+    int64_t next = 0;
+    int i;
+
+    if (timerfd < 0)
+	return;
+
+    for (i = 0; i < childcnt; ++i)
+	if ((children[i].pid != 0) && (children[i].deadline != 0) && !children[i].killed &&
+		((next == 0) || (children[i].deadline < next)))
+	    next = children[i].deadline;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = next / 1000;
+    its.it_value.tv_nsec = (next % 1000) * 1000000;
+    timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+/* The reason why a command may not be started now, or NULL */
+static const char *limited(key_cmd *cmd) {
+    int i, n = 0;
+
+    if ((maxcmds > 0) && (childcnt >= maxcmds))
+	return "as too many commands are running";
+
+    if (cmd->maxrun <= 0)
+	return NULL;
+
+    for (i = 0; i < childcnt; ++i)
+	if (children[i].rule == cmd)
+	    ++n;
+
+    return (n < cmd->maxrun)?NULL:"which is already running";
+}
+
+
+/* Report and forget a command that has exited, starting a command that has
+ * been put off in its place */
+static void end_child(int i, int status) {
+    child_t *child = &(children[i]);
+    int64_t ms = now_ms() - child->start;
+    key_cmd *rule;
+    int j;
+
+    if (child->killed) {
+	if (verbose > 0)
+	    lprintf("Command %s killed after %lli ms\n", child->cmd, (long long)ms);
+    } else if (WIFSIGNALED(status)) {
+	++stats.failed;
+	if (verbose > 0)
+	    lprintf("Command %s killed by signal %i\n", child->cmd, WTERMSIG(status));
+    } else if (WEXITSTATUS(status) != 0) {
+	++stats.failed;
+	if (verbose > 0)
+	    lprintf("Command %s exited with status %i\n", child->cmd, WEXITSTATUS(status));
+    } else if (verbose > 2) {
+	lprintf("Command %s completed in %lli ms\n", child->cmd, (long long)ms);
+    }
+
+    if (child->rule != NULL)
+	child->rule->status = status;
+
+    free(child->cmd);
+    children[i] = children[--childcnt];
+
+    /* The queue is kept in order */
+    for (j = 0; j < queuecnt; ++j) {
+	if (limited(queued[j]) != NULL)
+	    continue;
+	rule = queued[j];
+	--queuecnt;
+	memmove(&(queued[j]), &(queued[j + 1]), (queuecnt - j) * sizeof(key_cmd *));
+	if (verbose > 0)
+	    lprintf("Executing: %s (coalesced)\n", rule->command);
+	spawn_cmd(rule, 0);
+	break;
+    }
+}
+
+
+/* Apply the limits to a command. Returns non-zero if it may be started now */
+static int may_run(key_cmd *cmd, int log) {
+    const char *why = limited(cmd);
+    key_cmd **tmp;
+    int i;
+
+    if (why == NULL)
+	return 1;
+
+    if ((cmd->attr_bits & BIT_ATTR_COALESCE) == 0) {
+	++stats.dropped;
+	if (log || (verbose > 1))
+	    lprintf("Dropped: %s, %s\n", cmd->command, why);
+	return 0;
+    }
+
+    /* Any number of requests result in a single run */
+    for (i = 0; i < queuecnt; ++i) {
+	if (queued[i] == cmd) {
+	    ++stats.dropped;
+	    if (log || (verbose > 1))
+		lprintf("Dropped: %s, which is already deferred\n", cmd->command);
+	    return 0;
+	}
+    }
+
+    if (queuecnt == queuemax) {
+	tmp = (key_cmd **)(realloc(queued, (queuemax + 16) * sizeof(key_cmd *)));
+	if (tmp == NULL) {
+	    lprintf("Error: memory allocation failed\n");
+	    return 0;
+	}
+	queued = tmp;
+	queuemax += 16;
+    }
+    queued[queuecnt++] = cmd;
+
+    if (log || (verbose > 1))
+	lprintf("Deferred: %s, %s\n", cmd->command, why);
+
+    return 0;
+}
+
+
+/* Forget about the entries of a rule set that is going away. Their running
+ * commands no longer count against the entries of the new one */
+void release_cmds() {
+    int i;
+
+    for (i = 0; i < childcnt; ++i)
+	children[i].rule = NULL;
+    queuecnt = 0;
+    rancnt = 0;
+}
+
+
+/* Hand a command over to the fork server. The request is never waited for -
+ * if it cannot be sent at once, the command is started directly */
+static int send_cmd(key_cmd *cmd, char **argv) {
+    static char msg[SRV_MSG];
+    srv_req *req = (srv_req *)msg;
+    char *path = (cmd->path != NULL)?cmd->path:SHELL;
+    size_t len = sizeof(srv_req), n;
+    child_t *child;
+    int i;
+
+    req->tag = ++srvtag;
+    if (req->tag == 0)
+	req->tag = ++srvtag;
+    req->argc = 0;
+
+    n = strlen(path) + 1;
+    if (len + n > SRV_MSG)
+	return INTERR;
+    memcpy(msg + len, path, n);
+    len += n;
+
+    for (i = 0; argv[i] != NULL; ++i) {
+	n = strlen(argv[i]) + 1;
+	if (len + n > SRV_MSG)
+	    return INTERR;
+	memcpy(msg + len, argv[i], n);
+	len += n;
+	++req->argc;
+    }
+
+    child = new_child();
+    if (child == NULL)
+	return MEMERR;
+
+    if (send(srvfd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)len) {
+	--childcnt;
+	return INTERR;
+    }
+
+    init_child(child, cmd, 0, req->tag);
+
+    return OK;
+}
+
+
+/* Start a command, through the shell if needed, unless that would exceed
+ * the limits. The outcome is reported if log is set */
+int spawn_cmd(key_cmd *cmd, int log) {
+    char *shargv[] = { "sh", "-c", cmd->command, NULL };
+    char **argv = (cmd->path != NULL)?cmd->argv:shargv;
+    child_t *child;
+    pid_t pid;
+    int ret;
+
+    if (!may_run(cmd, log))
+	return NOMATCH;
+
+    if (log)
+	lprintf("Executing: %s\n", cmd->command);
+
+    if ((srvfd >= 0) && (send_cmd(cmd, argv) == OK))
+	return OK;
+
+    if ((!spawninit) && (init_spawn() != OK)) {
+	lprintf("Error: could not set up the command execution\n");
+	return INTERR;
+    }
+
+    child = new_child();
+    if (child == NULL)
+	return MEMERR;
+
+    ret = posix_spawn(&pid, (cmd->path != NULL)?cmd->path:SHELL, NULL, &spawnattr, argv, environ);
+    if (ret != 0) {
+	--childcnt;
+	++stats.failed;
+	lprintf("Error: could not execute %s: %s\n", cmd->command, strerror(ret));
+	return FORKERR;
+    }
+
+    init_child(child, cmd, pid, 0);
+    join_cgroup(pid);
+    count_run(cmd);
+    if (child->deadline != 0)
+	arm_timer();
+
+    if (verbose > 2)
+	lprintf("Started process %i\n", pid);
+
+    return OK;
+}
+
+
+/* Collect the commands that have exited */
+void reap_cmds() {
+    pid_t pid;
+    int i, status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	for (i = 0; i < childcnt; ++i)
+	    if ((children[i].pid == pid) && (children[i].tag == 0))
+		break;
+	if (i < childcnt)
+	    end_child(i, status);
+    }
+}
+
+
+/* The descriptor of the watchdog timer, or -1 */
+int timer_fd() {
+    return timerfd;
+}
+
+
+/* Kill the commands that have run out of time, with their process groups */
+void timer_events() {
+    uint64_t val;
+    int64_t now;
+    int i;
+
+    if ((read(timerfd, &val, sizeof(val)) < 0) && (errno != EAGAIN))
+	return;
+
+    now = now_ms();
+    for (i = 0; i < childcnt; ++i) {
+	if ((children[i].pid == 0) || (children[i].deadline == 0) ||
+		children[i].killed || (children[i].deadline > now))
+	    continue;
+
+	if (verbose > 1)
+	    lprintf("Killing %s, which has run out of time\n", children[i].cmd);
+	if (kill(-children[i].pid, SIGKILL) != 0)
+	    kill(children[i].pid, SIGKILL);
+	children[i].killed = 1;
+	++stats.killed;
+    }
+
+    arm_timer();
+}
+
+
+/* Report the command statistics, the outcome of the last command of each
+ * entry since the last reload, and the commands that are running */
+void report_cmds() {
+    int64_t now = now_ms();
+    int i, st;
+
+    lprintf("%i commands running, %lu started, %lu failed, %lu killed, %lu dropped\n",
+	    childcnt, stats.started, stats.failed, stats.killed, stats.dropped);
+
+    for (i = 0; i < rancnt; ++i) {
+	st = ran[i]->status;
+	if (st == -1)
+	    lprintf("Command %s: %lu runs, none finished\n", ran[i]->command, ran[i]->runs);
+	else if (WIFSIGNALED(st))
+	    lprintf("Command %s: %lu runs, the last killed by signal %i\n",
+		    ran[i]->command, ran[i]->runs, WTERMSIG(st));
+	else
+	    lprintf("Command %s: %lu runs, the last exited with status %i\n",
+		    ran[i]->command, ran[i]->runs, WEXITSTATUS(st));
+    }
+
+    if (verbose < 2)
+	return;
+    for (i = 0; i < childcnt; ++i)
+	lprintf("Process %i: %s, running for %lli ms\n", children[i].pid, children[i].cmd,
+		(long long)(now - children[i].start));
+}
+
+
+/*
+ * The fork server. It is forked while actkbd is still small, and only
+ * starts the commands that it receives and reports on them, so that the
+ * event loop just has to send a message for each command.
+ */
+
+static void srv_report(int fd, uint32_t tag, int event, pid_t pid, int status) {
+    srv_rep rep;
+
+    rep.tag = tag;
+    rep.event = event;
+    rep.pid = pid;
+    rep.status = status;
+    send(fd, &rep, sizeof(rep), MSG_NOSIGNAL);
+}
+
+
+/* Close every descriptor above stderr, except for one */
+static void close_fds(int keep) {
+    struct dirent *ent;
+    DIR *dir;
+    int fd;
+
+    if (((keep == 3) || (close_range(3, keep - 1, 0) == 0)) &&
+	    (close_range(keep + 1, ~0U, 0) == 0))
+	return;
+
+    /* Older kernels - only the open descriptors are listed */
+    dir = opendir("/proc/self/fd");
+    if (dir == NULL)
+	return;
+    while ((ent = readdir(dir)) != NULL) {
+	fd = atoi(ent->d_name);
+	if ((fd > 2) && (fd != keep) && (fd != dirfd(dir)))
+	    close(fd);
+    }
+    closedir(dir);
+}
+
+
+static void serve(int fd) {
+    static char msg[SRV_MSG + 1];
+    struct signalfd_siginfo si;
+    struct pollfd pfd[2];
+    child_t *run = NULL, *tmp;
+    int runcnt = 0, runmax = 0;
+    char *argv[SRV_MSG / 2 + 1], *p;
+    srv_req *req = (srv_req *)msg;
+    sigset_t set;
+    ssize_t len;
+    uint32_t i;
+    pid_t pid;
+    int status, ret;
+
+    prctl(PR_SET_NAME, "actkbd-exec");
+
+    /* A restarted server must not keep the devices open */
+    close_fds(fd);
+
+    /* The server is started before actkbd becomes a daemon, so it has to
+     * detach itself, for the sake of its commands. A server that cannot do
+     * so exits, and the commands are then started directly */
+    if (detach) {
+	setsid();
+	if (chdir("/") != 0)
+	    _exit(INTERR);
+	ret = open("/dev/null", O_RDWR);
+	if (ret >= 0) {
+	    dup2(ret, 0);
+	    dup2(ret, 1);
+	    dup2(ret, 2);
+	    if (ret > 2)
+		close(ret);
+	}
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    pfd[1].events = POLLIN;
+    if ((pfd[1].fd < 0) || (init_spawn() != OK))
+	_exit(INTERR);
+
+    while (1) {
+	if (poll(pfd, 2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    _exit(INTERR);
+	}
+
+	if (pfd[1].revents & POLLIN) {
+	    while (read(pfd[1].fd, &si, sizeof(si)) == sizeof(si));
+	    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < (uint32_t)runcnt; ++i)
+		    if (run[i].pid == pid)
+			break;
+		if (i == (uint32_t)runcnt)
+		    continue;
+		srv_report(fd, run[i].tag, SRV_EXITED, pid, status);
+		run[i] = run[--runcnt];
+	    }
+	}
+
+	if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+	    continue;
+
+	/* actkbd has gone away - the commands are left running */
+	len = recv(fd, msg, SRV_MSG, 0);
+	if (len <= 0)
+	    _exit(OK);
+	if ((size_t)len < sizeof(srv_req))
+	    continue;
+	msg[len] = '\0';
+
+	/* The program, then the arguments */
+	p = msg + sizeof(srv_req);
+	for (i = 0; (i <= req->argc) && (p < msg + len); ++i) {
+	    argv[i] = p;
+	    p += strlen(p) + 1;
+	}
+	if (i != req->argc + 1) {
+	    srv_report(fd, req->tag, SRV_FAILED, 0, EINVAL);
+	    continue;
+	}
+	argv[i] = NULL;
+
+	if (runcnt == runmax) {
+	    tmp = (child_t *)(realloc(run, (runmax + 16) * sizeof(child_t)));
+	    if (tmp == NULL) {
+		srv_report(fd, req->tag, SRV_FAILED, 0, ENOMEM);
+		continue;
+	    }
+	    run = tmp;
+	    runmax += 16;
+	}
+
+	ret = posix_spawn(&pid, argv[0], NULL, &spawnattr, argv + 1, environ);
+	if (ret != 0) {
+	    srv_report(fd, req->tag, SRV_FAILED, 0, ret);
+	    continue;
+	}
+
+	run[runcnt].pid = pid;
+	run[runcnt].tag = req->tag;
+	++runcnt;
+	srv_report(fd, req->tag, SRV_STARTED, pid, 0);
+    }
+}
+
+
+int start_server() {
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+	lprintf("Warning: could not start the fork server: %s\n", strerror(errno));
+	return FORKERR;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+	lprintf("Warning: could not start the fork server: %s\n", strerror(errno));
+	close(sv[0]);
+	close(sv[1]);
+	return FORKERR;
+    }
+
+    if (pid == 0) {
+	close(sv[0]);
+	serve(sv[1]);
+    }
+
+    close(sv[1]);
+    srvfd = sv[0];
+    srvstart = time(NULL);
+
+    /* The commands that it starts are then created in the cgroup */
+    join_cgroup(pid);
+
+    if (verbose > 1)
+	lprintf("Started the fork server (process %i)\n", pid);
+
+    return OK;
+}
+
+
+void stop_server() {
+    if (srvfd < 0)
+	return;
+
+    close(srvfd);
+    srvfd = -1;
+}
+
+
+/* The descriptor to wait for the fork server reports with, or -1 */
+int server_fd() {
+    return srvfd;
+}
+
+
+/* Handle the fork server reports */
+void server_events() {
+    srv_rep rep;
+    ssize_t len;
+    int i;
+
+    if (srvfd < 0)
+	return;
+
+    while ((len = recv(srvfd, &rep, sizeof(rep), MSG_DONTWAIT)) == sizeof(rep)) {
+	for (i = 0; i < childcnt; ++i)
+	    if (children[i].tag == rep.tag)
+		break;
+	if (i == childcnt)
+	    continue;
+
+	if (rep.event == SRV_STARTED) {
+	    children[i].pid = rep.pid;
+	    count_run(children[i].rule);
+	    if (children[i].deadline != 0)
+		arm_timer();
+	    if (verbose > 2)
+		lprintf("Started process %i\n", rep.pid);
+	} else if (rep.event == SRV_EXITED) {
+	    end_child(i, rep.status);
+	} else {
+	    ++stats.failed;
+	    lprintf("Error: could not execute %s: %s\n", children[i].cmd, strerror(rep.status));
+	    free(children[i].cmd);
+	    children[i] = children[--childcnt];
+	}
+    }
+
+    if ((len > 0) || ((len < 0) && ((errno == EAGAIN) || (errno == EINTR))))
+	return;
+
+    /* The server has died, along with what it knew about its commands. It is
+     * not restarted if it keeps dying */
+    lprintf("Warning: the fork server has exited\n");
+    queuecnt = 0;
+    for (i = 0; i < childcnt; )
+	if (children[i].tag != 0) {
+	    free(children[i].cmd);
+	    children[i] = children[--childcnt];
+	} else {
+	    ++i;
+	}
+
+    stop_server();
+    if (time(NULL) - srvstart > 1)
+	start_server();
+    else
+	lprintf("Warning: commands will be started directly\n");
+    watch_server(srvfd);
+}
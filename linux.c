@@ -10,105 +10,626 @@
 
 #include "actkbd.h"
 
-#include <regex.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
 
 #include <linux/input.h>
+#include <linux/uinput.h>
 
-#define PROCFS "/proc/"
-#define HANDLERS "bus/input/handlers"
-#define DEVICES "bus/input/devices"
-#define DEVNODE "/dev/input/event"
+/* The io_uring event loop only needs the kernel interface header */
+#if !defined(NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING
+#endif
+#endif
 
+#ifdef HAVE_URING
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
-/* The device node */
-static char devnode[32];
+#define DEVDIR "/dev/input"
+#define DEVNODE DEVDIR "/event"
+#define UINPUT "/dev/uinput"
 
-/* The device file pointer */
-static FILE *dev;
+/* The name of the virtual output device */
+#define OUTNAME "actkbd"
 
+/* Older headers only have the timeval member */
+#ifndef input_event_sec
+#define input_event_sec		time.tv_sec
+#define input_event_usec	time.tv_usec
+#endif
 
-int init_dev() {
-    FILE *fp = NULL;
-    int ret;
-    unsigned int u0, u1;
-    regex_t preg;
-    regmatch_t pmatch[4];
+#if KEY_MAX >= MASK_KEYS
+#error "MASK_KEYS is too small for this KEY_MAX value"
+#endif
+
+
+/* Key code bitmap size, in longs */
+#define BITS_LONG	(8 * sizeof(unsigned long))
+#define KEY_LONGS	((KEY_CNT + BITS_LONG - 1) / BITS_LONG)
+
+#define TEST_BIT(bits, k)	(((bits)[(k) / BITS_LONG] >> ((k) % BITS_LONG)) & 1)
+
+/* Number of events read with a single system call */
+#define EVBUF		256
+
+/* The per-device event buffer. It may end with a partially read event */
+typedef struct {
+    struct input_event ev[EVBUF];
+    size_t bytes;			/* Bytes in the buffer */
+    int pos;				/* The next event */
+    int dropping;			/* Events are being dropped */
+    int nomask;				/* The kernel cannot filter the events */
+
+    /* The read state of the io_uring event loop */
+    int inflight;			/* A read has been submitted */
+    int ready;				/* The read has completed */
+    int err;				/* The read error, -1 for end of file */
+} evbuf_t;
+
+/* Number of readiness events received with a single system call */
+#define LOOPEVS		16
+
+/* The event loop descriptors */
+static int epfd = -1;
+static int sigfd = -1;
+static int wakefd = -1;
+static int inofd = -1;
+static int srvfd = -1;
+static int timerfd = -1;
+
+/* Readiness events that have not been handled yet */
+static struct epoll_event loopev[LOOPEVS];
+static int loopcnt = 0, looppos = 0;
+
+/* Number of open devices that cannot be waited for */
+static int unpolled = 0;
+
+/* The event loop uses io_uring instead of epoll */
+static int useuring = 0;
 
+#ifdef HAVE_URING
+/* Number of submission queue entries */
+#define RING_ENTRIES	64
+
+/* The io_uring instance and its shared rings */
+static struct {
+    int fd;
+    unsigned int *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned int *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int entries;
+    unsigned int tail;			/* The submission queue tail, with
+					 * the entries that are still queued */
+} ring = { .fd = -1 };
+
+/* A descriptor that the io_uring event loop polls for */
+typedef struct {
+    int *fd;
+    int armed;				/* A poll has been submitted */
+    int ready;				/* The poll has completed */
+} ctl_t;
+
+#define CTLS		8
+
+static ctl_t ctls[CTLS];
+static int ctlcnt = 0;
+#endif
+
+/* A watched device directory */
+typedef struct {
+    int wd;				/* The inotify watch descriptor */
+    char *dir;				/* The directory name */
+} watch_t;
+
+/* The hotplug watcher state */
+static watch_t *watches = NULL;
+static int watchcnt = 0;
+static int hotdetect = 0;		/* New keyboards are detected */
+static int hotall = 0;			/* All new keyboards are used */
+
+/* The output device. Without uinput the events are written back to the input
+ * devices */
+static int outfd = -1;
+
+/* Maximum number of queued output events */
+#define OUTBUF		64
+
+/* The queued output events, with room for the final report */
+static struct input_event outbuf[OUTBUF + 1];
+static int outcnt = 0;
+
+/* The inotify event buffer */
+static char inobuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+static size_t inobytes = 0, inopos = 0;
+
+
+int init_dev() {
     maxkey = KEY_MAX;
 
-    fp = fopen(PROCFS HANDLERS, "r");
-    if (fp == NULL) {
-	lprintf("Error: could not open " PROCFS HANDLERS ": %s\n", strerror(errno));
-	return HOSTFAIL;
+    return OK;
+}
+
+
+/* Probe a device, returning the number of the specified keys that it has, or
+ * -1 if it is not a keyboard or does not fit the match criteria. A keyboard
+ * is a device with keys that the kernel keyboard handler would accept */
+static int probe_dev(char *name, keymask_t *keys) {
+    unsigned long bits[KEY_LONGS];
+    struct input_id id;
+    char str[256];
+    int fd, k, cover = -1;
+
+    fd = open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+	return -1;
+
+    memset(bits, 0, sizeof(bits));
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits) < 0)
+	goto DONE;
+
+    for (k = 1; k < KEY_CNT; ++k) {
+	if ((k >= BTN_MISC) && (k < KEY_OK))
+	    continue;
+	if (TEST_BIT(bits, k))
+	    break;
     }
-    do {
-	ret = fscanf(fp, "N: Number=%u Name=evdev Minor=%u", &u0, &u1);
-	fscanf(fp, "%*s\n");
-    } while ((!feof(fp)) && (ret < 2));
-    if (ret < 2) {
-	lprintf("Error: event interface not available\n");
-	return HOSTFAIL;
+    if (k == KEY_CNT)
+	goto DONE;
+
+    if ((devmatch.vendor >= 0) || (devmatch.product >= 0)) {
+	if ((ioctl(fd, EVIOCGID, &id) < 0) ||
+		((devmatch.vendor >= 0) && (id.vendor != devmatch.vendor)) ||
+		((devmatch.product >= 0) && (id.product != devmatch.product)))
+	    goto DONE;
     }
-    if (verbose > 1)
-	lprintf("Event interface present (handler %u)\n", u0);
-    fclose(fp);
 
-    /* Skip auto-detection when the device has been specified */
-    if (device)
-	return OK;
+    /* Never use the output device, which would feed the events back */
+    memset(str, 0, sizeof(str));
+    if ((ioctl(fd, EVIOCGNAME(sizeof(str) - 1), str) < 0) ||
+	    (strcmp(str, OUTNAME) == 0) ||
+	    ((devmatch.name != NULL) && (fnmatch(devmatch.name, str, 0) != 0)))
+	goto DONE;
+
+    memset(str, 0, sizeof(str));
+    if ((devmatch.phys != NULL) &&
+	    ((ioctl(fd, EVIOCGPHYS(sizeof(str) - 1), str) < 0) ||
+	     (fnmatch(devmatch.phys, str, 0) != 0)))
+	goto DONE;
+
+    cover = 0;
+    for (k = next_mask_bit(keys, 0); (k >= 0) && (k < KEY_CNT); k = next_mask_bit(keys, k + 1))
+	cover += TEST_BIT(bits, k);
+
+DONE:
+    close(fd);
+
+    return cover;
+}
+
 
-    fp = fopen(PROCFS DEVICES, "r");
-    if (fp == NULL) {
-	lprintf("Error: could not open " PROCFS DEVICES ": %s\n", strerror(errno));
+/* Check whether a device is worth using with the configuration in use - it
+ * must have at least one of its keys */
+static int usable_dev(char *name) {
+    keymask_t keys;
+    int n;
+
+    config_used(&keys);
+    n = cnt_mask(&keys);
+
+    return probe_dev(name, &keys) >= ((n > 0)?1:0);
+}
+
+
+static int cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+
+/* Keyboard auto-detection. The event devices are probed directly, and the
+ * ones that have the keys used in the configuration file are preferred -
+ * either the best one is used, or all that have any of those keys */
+int detect_dev(int all) {
+    struct dirent *ent;
+    keymask_t keys;
+    DIR *dir;
+    char node[32];
+    int *nums = NULL, *tmp, cnt = 0, i, n, need, cover, best = -1, bestcover = -1;
+
+    dir = opendir(DEVDIR);
+    if (dir == NULL) {
+	lprintf("Error: could not open " DEVDIR ": %s\n", strerror(errno));
 	return HOSTFAIL;
     }
 
-    /* Compile the regular expression and scan for it */
-    ret = -1;
-    regcomp(&preg, "^H: Handlers=(.* )?kbd (.* )?event([0-9]+)", REG_EXTENDED);
-    do {
-	char l[128] = "";
-	void *str = fgets(l, 128, fp);
-	if (str == NULL)
-	    break;
-	ret = regexec(&preg, l, 4, pmatch, 0);
-	if (ret == 0) {
-	    l[pmatch[3].rm_eo] = '\0';
-	    ret = sscanf(l + pmatch[3].rm_so, "%u", &u0);
-	} else {
-	    ret = -1;
+    /* Probe the devices in order */
+    while ((ent = readdir(dir)) != NULL) {
+	if (sscanf(ent->d_name, "event%d", &n) < 1)
+	    continue;
+	tmp = (int *)(realloc(nums, (cnt + 1) * sizeof(int)));
+	if (tmp == NULL) {
+	    lprintf("Error: memory allocation failed\n");
+	    closedir(dir);
+	    free(nums);
+	    return MEMERR;
 	}
-    } while ((!feof(fp)) && (ret < 1));
-    regfree(&preg);
+	nums = tmp;
+	nums[cnt++] = n;
+    }
+    closedir(dir);
+    qsort(nums, cnt, sizeof(int), cmp_int);
+
+    config_used(&keys);
+    need = cnt_mask(&keys);
+
+    for (i = 0; i < cnt; ++i) {
+	sprintf(node, DEVNODE "%i", nums[i]);
+	cover = probe_dev(node, &keys);
+	if ((cover < 0) || ((need > 0) && (cover == 0)))
+	    continue;
+
+	if (verbose > 1)
+	    lprintf("Detected a usable keyboard device (event%i, %i of %i keys)\n",
+		    nums[i], cover, need);
+
+	if (all) {
+	    if (add_device(strdup(node)) != OK) {
+		free(nums);
+		return MEMERR;
+	    }
+	} else if (cover > bestcover) {
+	    best = nums[i];
+	    bestcover = cover;
+	    if (cover == need)
+		break;
+	}
+    }
+    free(nums);
 
-    if (ret < 1) {
+    if (best >= 0) {
+	sprintf(node, DEVNODE "%i", best);
+	if (add_device(strdup(node)) != OK)
+	    return MEMERR;
+    }
+
+    if (devcnt == 0) {
 	lprintf("Error: could not detect a usable keyboard device\n");
 	return HOSTFAIL;
     }
-    if (verbose > 1)
-	lprintf("Detected a usable keyboard device (event%u)\n", u0);
 
-    fclose(fp);
-    sprintf(devnode, DEVNODE "%u", u0);
-    device = devnode;
+    return OK;
+}
+
+
+#ifdef HAVE_URING
+/*
+ * The io_uring primitives. The rings are driven with the raw system calls, so
+ * that no library is needed - each device always has a read outstanding, and
+ * the other descriptors of the event loop a poll, and all of them complete on
+ * the same queue.
+ */
+
+static int ring_setup() {
+    struct io_uring_params p;
+    size_t sqsize, cqsize;
+    char *sq, *cq = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    int fd, err;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (fd < 0)
+	return INTERR;
+
+    /* Regular files must be read from their current position */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+	close(fd);
+	errno = EOPNOTSUPP;
+	return INTERR;
+    }
+
+    sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && (cqsize > sqsize))
+	sqsize = cqsize;
+
+    sq = (char *)(mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd, IORING_OFF_SQ_RING));
+    if (sq == MAP_FAILED)
+	goto FAIL;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	cq = sq;
+    else
+	cq = (char *)(mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    fd, IORING_OFF_CQ_RING));
+    if (cq == MAP_FAILED)
+	goto FAIL;
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+	goto FAIL;
+
+    ring.sqhead = (unsigned int *)(sq + p.sq_off.head);
+    ring.sqtail = (unsigned int *)(sq + p.sq_off.tail);
+    ring.sqmask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring.sqarray = (unsigned int *)(sq + p.sq_off.array);
+    ring.cqhead = (unsigned int *)(cq + p.cq_off.head);
+    ring.cqtail = (unsigned int *)(cq + p.cq_off.tail);
+    ring.cqmask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.sqes = (struct io_uring_sqe *)sqes;
+    ring.entries = p.sq_entries;
+    ring.tail = *(ring.sqtail);
+    ring.fd = fd;
+
+    return OK;
+
+FAIL:
+    err = errno;
+    if ((cq != MAP_FAILED) && (cq != sq))
+	munmap(cq, cqsize);
+    if (sq != MAP_FAILED)
+	munmap(sq, sqsize);
+    close(fd);
+    errno = err;
+
+    return INTERR;
+}
+
+
+/* Submit the queued entries, optionally waiting for a completion */
+static int ring_enter(unsigned int wait) {
+    unsigned int n;
+
+    __atomic_store_n(ring.sqtail, ring.tail, __ATOMIC_RELEASE);
+    n = ring.tail - __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE);
+
+    if (syscall(__NR_io_uring_enter, ring.fd, n, wait,
+		(wait > 0)?IORING_ENTER_GETEVENTS:0, NULL, 0) < 0) {
+	/* The completions have to be reaped first when the queue is full */
+	if ((errno != EINTR) && (errno != EBUSY) && (errno != EAGAIN))
+	    return INTERR;
+    }
+
+    return OK;
+}
+
+
+/* Get a cleared submission queue entry */
+static struct io_uring_sqe *ring_sqe() {
+    struct io_uring_sqe *sqe;
+    unsigned int idx;
+
+    if (ring.tail - __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE) >= ring.entries)
+	ring_enter(0);
+
+    idx = ring.tail & *(ring.sqmask);
+    sqe = &(ring.sqes[idx]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring.sqarray[idx] = idx;
+    ++ring.tail;
+
+    return sqe;
+}
+
+
+/* Read into the free part of the event buffer of a device */
+static void submit_read(kbd_t *dev) {
+    evbuf_t *buf = (evbuf_t *)(dev->buf);
+    size_t used = buf->pos * sizeof(struct input_event);
+    struct io_uring_sqe *sqe;
+
+    memmove(buf->ev, (char *)buf->ev + used, buf->bytes - used);
+    buf->bytes -= used;
+    buf->pos = 0;
+
+    sqe = ring_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = dev->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uint64_t)(uintptr_t)((char *)buf->ev + buf->bytes);
+    sqe->len = sizeof(buf->ev) - buf->bytes;
+    sqe->user_data = (uint64_t)(uintptr_t)dev;
+
+    buf->inflight = 1;
+}
+
+
+static void submit_poll(ctl_t *ctl) {
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = *(ctl->fd);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    sqe->poll32_events = POLLIN << 16;
+#else
+    sqe->poll32_events = POLLIN;
+#endif
+    sqe->user_data = (uint64_t)(uintptr_t)(ctl->fd);
+
+    ctl->armed = 1;
+}
+
+
+/* Handle the completions. The devices and the polled descriptors are only
+ * marked as ready, for wait_loop() to report them */
+static void ring_reap() {
+    struct io_uring_cqe *cqe;
+    unsigned int head = *(ring.cqhead);
+    evbuf_t *buf;
+    void *ptr;
+    int i, res;
+
+    while (head != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE)) {
+	cqe = &(ring.cqes[head & *(ring.cqmask)]);
+	ptr = (void *)(uintptr_t)(cqe->user_data);
+	res = cqe->res;
+	__atomic_store_n(ring.cqhead, ++head, __ATOMIC_RELEASE);
+
+	/* A cancellation request */
+	if (ptr == NULL)
+	    continue;
+
+	for (i = 0; i < ctlcnt; ++i)
+	    if (ctls[i].fd == ptr)
+		break;
+	if (i < ctlcnt) {
+	    ctls[i].armed = 0;
+	    ctls[i].ready = 1;
+	    continue;
+	}
+
+	buf = (evbuf_t *)(((kbd_t *)ptr)->buf);
+	buf->inflight = 0;
+	if (res > 0) {
+	    buf->bytes += res;
+	} else if (res == 0) {
+	    buf->err = -1;
+	} else if ((res == -EINTR) || (res == -EAGAIN) || (res == -ECANCELED)) {
+	    /* Read again, unless the device is being closed */
+	    continue;
+	} else {
+	    buf->err = -res;
+	}
+	buf->ready = 1;
+    }
+}
+
+
+/* Cancel the outstanding read of a device, which must not complete into
+ * freed memory */
+static int cancel_read(kbd_t *dev) {
+    evbuf_t *buf = (evbuf_t *)(dev->buf);
+    struct io_uring_sqe *sqe;
+
+    if (!buf->inflight)
+	return OK;
+
+    sqe = ring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)dev;
+    sqe->user_data = 0;
+
+    while (buf->inflight) {
+	if (ring_enter(1) != OK)
+	    return INTERR;
+	ring_reap();
+    }
 
     return OK;
 }
+#endif
+
 
+int open_dev(char *name) {
+    struct epoll_event ev;
+    kbd_t *dev;
+    int k;
+
+    dev = (kbd_t *)(calloc(1, sizeof(kbd_t)));
+    if (dev != NULL)
+	dev->buf = calloc(1, sizeof(evbuf_t));
+    if ((dev == NULL) || (dev->buf == NULL)) {
+	lprintf("Error: memory allocation failed\n");
+	free(dev);
+	return MEMERR;
+    }
+    dev->name = name;
 
-int open_dev() {
-    dev = fopen(device, "a+");
-    if (dev == NULL) {
-	lprintf("Error: could not open %s: %s\n", device, strerror(errno));
+    dev->fd = open(name, O_RDWR | O_APPEND);
+    if (dev->fd < 0) {
+	lprintf("Error: could not open %s: %s\n", name, strerror(errno));
+	free(dev->buf);
+	free(dev);
 	return DEVFAIL;
     }
+
+    /* Have the events stamped with the clock used to measure their delay */
+    k = CLOCK_MONOTONIC;
+    dev->clock = (ioctl(dev->fd, EVIOCSCLOCKID, &k) == 0);
+
+    /* Regular files, such as event recordings, are always ready. With
+     * io_uring the reads are submitted by the event loop */
+    ev.events = EPOLLIN;
+    ev.data.ptr = dev;
+    dev->polled = 1;
+    if ((!useuring) && (epoll_ctl(epfd, EPOLL_CTL_ADD, dev->fd, &ev) != 0)) {
+	if (errno != EPERM) {
+	    lprintf("Error: could not watch %s: %s\n", name, strerror(errno));
+	    close(dev->fd);
+	    free(dev->buf);
+	    free(dev);
+	    return DEVFAIL;
+	}
+	dev->polled = 0;
+	++unpolled;
+    }
+
+    dev->next = kbds;
+    kbds = dev;
+
+    if (verbose > 1)
+	lprintf("Opened %s\n", name);
+
     return OK;
 }
 
 
-int close_dev() {
-    fclose(dev);
+int close_dev(kbd_t *dev) {
+    kbd_t **p;
+    int i, keep = 0;
+
+    if (useuring) {
+#ifdef HAVE_URING
+	/* A read that could not be cancelled may still complete into the
+	 * buffer, which is then never freed */
+	if (cancel_read(dev) != OK) {
+	    lprintf("Error: could not cancel the reads of %s: %s\n", dev->name, strerror(errno));
+	    keep = 1;
+	}
+#endif
+    } else if (dev->polled) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+    } else {
+	--unpolled;
+    }
+
+    /* Forget about any readiness events that have not been handled yet */
+    for (i = looppos; i < loopcnt; ++i)
+	if (loopev[i].data.ptr == dev)
+	    loopev[i].data.ptr = NULL;
+
+    close(dev->fd);
+
+    for (p = &kbds; *p != NULL; p = &((*p)->next)) {
+	if (*p == dev) {
+	    *p = dev->next;
+	    break;
+	}
+    }
+
+    if (kbd == dev)
+	kbd = NULL;
+
+    if (keep)
+	return INTERR;
+
+    free(dev->buf);
+    free(dev);
+
     return OK;
 }
 
@@ -116,14 +637,14 @@ int close_dev() {
 int grab_dev() {
     int ret;
 
-    if (grabbed)
+    if (kbd->grabbed)
 	return 0;
 
-    ret = ioctl(fileno(dev), EVIOCGRAB, (void *)1);
+    ret = ioctl(kbd->fd, EVIOCGRAB, (void *)1);
     if (ret == 0)
-	grabbed = 1;
+	kbd->grabbed = 1;
     else
-	lprintf("Error: could not grab %s: %s\n", device, strerror(errno));
+	lprintf("Error: could not grab %s: %s\n", kbd->name, strerror(errno));
     
     return ret;
 }
@@ -132,103 +653,835 @@ int grab_dev() {
 int ungrab_dev() {
     int ret;
 
-    if (!grabbed)
+    if (!kbd->grabbed)
 	return 0;
 
-    ret = ioctl(fileno(dev), EVIOCGRAB, (void *)0);
+    ret = ioctl(kbd->fd, EVIOCGRAB, (void *)0);
     if (ret == 0)
-	grabbed = 0;
+	kbd->grabbed = 0;
     else
-	lprintf("Error: could not ungrab %s: %s\n", device, strerror(errno));
+	lprintf("Error: could not ungrab %s: %s\n", kbd->name, strerror(errno));
 	
     return ret;
 }
 
 
-int get_key(int *key, int *type) {
-    struct input_event ev;
-    int ret;
+/* Have the kernel drop the events that would be discarded anyway, so that
+ * they do not cause any wakeups. Only key and synchronization events are
+ * ever used, and of the key events only the specified ones */
+int filter_dev(keymask_t *keys) {
+    evbuf_t *buf = (evbuf_t *)(kbd->buf);
+    int dev = kbd->fd;
+    unsigned long bits[KEY_LONGS];
+    struct input_mask mask;
+    int k, t;
+
+    if (buf->nomask)
+	return DEVFAIL;
+
+    memset(bits, 0, sizeof(bits));
+    for (k = next_mask_bit(keys, 0); (k >= 0) && (k < KEY_CNT); k = next_mask_bit(keys, k + 1))
+	bits[k / BITS_LONG] |= 1UL << (k % BITS_LONG);
+
+    mask.type = EV_KEY;
+    mask.codes_size = sizeof(bits);
+    mask.codes_ptr = (uint64_t)(unsigned long)bits;
+    if (ioctl(dev, EVIOCSMASK, &mask) != 0) {
+	/* Not an evdev device, or an older kernel - filter in get_keys() */
+	if ((errno == EINVAL) || (errno == ENOTTY)) {
+	    if (verbose > 1)
+		lprintf("Kernel event filtering is not available for %s\n", kbd->name);
+	    buf->nomask = 1;
+	} else {
+	    lprintf("Error: could not set the event mask for %s: %s\n", kbd->name, strerror(errno));
+	}
+	return DEVFAIL;
+    }
+
+    /* An empty mask filters out a whole event type */
+    for (t = 0; t <= EV_MAX; ++t) {
+	if ((t == EV_SYN) || (t == EV_KEY))
+	    continue;
+
+	mask.type = t;
+	mask.codes_size = 0;
+	mask.codes_ptr = 0;
+	ioctl(dev, EVIOCSMASK, &mask);
+    }
+
+    if (verbose > 1)
+	lprintf("Kernel event filtering enabled for %i keys\n", cnt_mask(keys));
+
+    return OK;
+}
+
+
+/* Refill the event buffer, keeping any partially read event */
+static int fill_buf(evbuf_t *buf) {
+    size_t used = buf->pos * sizeof(struct input_event);
+    ssize_t ret;
+
+    /* With io_uring the reads are submitted by the event loop, and only
+     * their errors are left to pick up here */
+    if (useuring) {
+	if (buf->err == 0)
+	    return OK;
+	errno = (buf->err > 0)?buf->err:0;
+	return READERR;
+    }
+
+    memmove(buf->ev, (char *)buf->ev + used, buf->bytes - used);
+    buf->bytes -= used;
+    buf->pos = 0;
 
     do {
-	ret = fread(&ev, sizeof(ev), 1, dev);
-	if (ret < 1) {
-	    lprintf("Error: failed to read event from %s: %s", device, strerror(errno));
-	    return READERR;
+	ret = read(kbd->fd, (char *)buf->ev + buf->bytes, sizeof(buf->ev) - buf->bytes);
+    } while ((ret < 0) && (errno == EINTR));
+
+    if (ret <= 0)
+	return READERR;
+
+    buf->bytes += ret;
+
+    return OK;
+}
+
+
+static int buf_pending(evbuf_t *buf) {
+    return buf->pos < (int)(buf->bytes / sizeof(struct input_event));
+}
+
+
+/* Check whether complete events of the current device are still buffered */
+int pending_keys() {
+    return buf_pending((evbuf_t *)(kbd->buf));
+}
+
+
+/* The key events are handed over a frame at a time, a frame being the events
+ * up to the next EV_SYN report. The device is only read from when nothing is
+ * buffered, so that a ready device never blocks the event loop - a frame is
+ * cut short, rather than waiting for more input, when the events that have
+ * been read run out */
+int get_keys(key_event *frame, int max, int *count) {
+    evbuf_t *buf = (evbuf_t *)(kbd->buf);
+    struct input_event *ev;
+    int type;
+
+    *count = 0;
+
+    if ((!pending_keys()) && (fill_buf(buf) != OK)) {
+	/* An unplugged device */
+	if (errno == ENODEV) {
+	    if (verbose > 0)
+		lprintf("Device %s has been removed\n", kbd->name);
+	    return DEVFAIL;
 	}
-    } while (ev.type != EV_KEY);
+	lprintf("Error: failed to read event from %s: %s", kbd->name, strerror(errno));
+	return READERR;
+    }
 
-    *key = ev.code;
+    while ((*count < max) && pending_keys()) {
 
-    switch (ev.value) {
-	case 0:
-	    *type = REL;
-	    break;
-	case 1:
-	    *type = KEY;
-	    break;
-	case 2:
-	    *type = REP;
-	    break;
-	default:
-	    *type = INVALID;
+	ev = &(buf->ev[buf->pos]);
+
+	if (ev->type == EV_SYN) {
+	    ++buf->pos;
+	    if (ev->code == SYN_DROPPED) {
+		/* The kernel buffer has overrun - the events up to the next
+		 * report are incomplete, and the key state must be read again */
+		*count = 0;
+		buf->dropping = 1;
+		kbd->resync = 1;
+		++kbd->overruns;
+		if (verbose > 0)
+		    lprintf("Events dropped by %s\n", kbd->name);
+	    } else if (ev->code == SYN_REPORT) {
+		/* Have the key state read before any further events */
+		if (buf->dropping) {
+		    buf->dropping = 0;
+		    return OK;
+		}
+		if (*count > 0)
+		    return OK;
+	    }
+	    continue;
+	}
+
+	if ((ev->type != EV_KEY) || buf->dropping) {
+	    ++buf->pos;
+	    continue;
+	}
+
+	switch (ev->value) {
+	    case 0:
+		type = REL;
+		break;
+	    case 1:
+		type = KEY;
+		break;
+	    case 2:
+		type = REP;
+		break;
+	    default:
+		type = INVALID;
+	}
+
+	if (ev->code > KEY_MAX)
+	    type = INVALID;
+
+	/* Hand over the valid events first */
+	if (type == INVALID) {
+	    if (*count > 0)
+		return OK;
+	    ++buf->pos;
+	    lprintf("Error: invalid event read from %s: code = %u, value = %u", kbd->name, ev->code, ev->value);
+	    return EVERR;
+	}
+
+	frame[*count].key = ev->code;
+	frame[*count].type = type;
+	frame[*count].time = (kbd->clock)?
+	    ((int64_t)(ev->input_event_sec) * 1000000000 + ev->input_event_usec * 1000):0;
+	++(*count);
+	++buf->pos;
     }
 
-    if (*key > KEY_MAX)
-	*type = INVALID;
+    return OK;
+}
+
+
+/* Convert a kernel key bitmap into a key mask */
+static void bits_to_mask(unsigned long *bits, keymask_t *mask) {
+    int k;
+
+    clear_mask(mask);
+    for (k = 0; k < KEY_CNT; ++k)
+	if (TEST_BIT(bits, k))
+	    mask->w[k / 64] |= (uint64_t)1 << (k % 64);
+}
+
+
+int get_key_state(keymask_t *state, keymask_t *avail) {
+    unsigned long bits[KEY_LONGS];
+
+    memset(bits, 0, sizeof(bits));
+    if (ioctl(kbd->fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits) < 0)
+	return DEVFAIL;
+    bits_to_mask(bits, avail);
+
+    memset(bits, 0, sizeof(bits));
+    if (ioctl(kbd->fd, EVIOCGKEY(sizeof(bits)), bits) < 0)
+	return DEVFAIL;
+    bits_to_mask(bits, state);
+
+    return OK;
+}
+
+
+/* Create a virtual keyboard for the generated key events, so that they reach
+ * the other applications even when the input devices are grabbed */
+int init_output() {
+    struct uinput_setup setup;
+    int k;
+
+    outfd = open(UINPUT, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (outfd < 0) {
+	if (verbose > 1)
+	    lprintf("Could not open " UINPUT " (%s), events will be sent to the input devices\n",
+		    strerror(errno));
+	return DEVFAIL;
+    }
+
+    if ((ioctl(outfd, UI_SET_EVBIT, EV_KEY) < 0) ||
+	    (ioctl(outfd, UI_SET_EVBIT, EV_SYN) < 0))
+	goto FAIL;
+    for (k = 1; k <= KEY_MAX; ++k)
+	if (ioctl(outfd, UI_SET_KEYBIT, k) < 0)
+	    goto FAIL;
+
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    strcpy(setup.name, OUTNAME);
+    if ((ioctl(outfd, UI_DEV_SETUP, &setup) < 0) ||
+	    (ioctl(outfd, UI_DEV_CREATE) < 0))
+	goto FAIL;
+
+    if (verbose > 1)
+	lprintf("Created a virtual output device\n");
+
+    return OK;
+
+FAIL:
+    lprintf("Warning: could not create a virtual output device: %s\n", strerror(errno));
+    close(outfd);
+    outfd = -1;
 
-    if (*type == INVALID) {
-        lprintf("Error: invalid event read from %s: code = %u, value = %u", device, ev.code, ev.value);
-	return EVERR;
+    return DEVFAIL;
+}
+
+
+void close_output() {
+    if (outfd < 0)
+	return;
+
+    ioctl(outfd, UI_DEV_DESTROY);
+    close(outfd);
+    outfd = -1;
+}
+
+
+int virtual_output() {
+    return outfd >= 0;
+}
+
+
+/* Send the queued events, along with a report, in a single write */
+int flush_keys() {
+    size_t len;
+    int fd;
+
+    if (outcnt == 0)
+	return OK;
+
+    memset(&(outbuf[outcnt]), 0, sizeof(struct input_event));
+    outbuf[outcnt].type = EV_SYN;
+    outbuf[outcnt].code = SYN_REPORT;
+    len = (outcnt + 1) * sizeof(struct input_event);
+    outcnt = 0;
+
+    fd = (outfd >= 0)?outfd:kbd->fd;
+    if (write(fd, outbuf, len) != (ssize_t)len) {
+	lprintf("Error: failed to send events to %s: %s\n",
+		(outfd >= 0)?OUTNAME:kbd->name, strerror(errno));
+	return WRITEERR;
     }
 
     return OK;
 }
 
 
+/* Queue a key event - the events are sent by flush_keys() */
 int snd_key(int key, int type) {
-    struct input_event ev;
-    int ret;
+    struct input_event *ev;
 
-    ev.type = EV_KEY;
-    ev.code = key;
+    if ((type != KEY) && (type != REL) && (type != REP))
+	return EINVAL;
 
-    switch (type) {
-	case KEY:
-	    ev.value = 1;
-	    break;
-	case REL:
-	    ev.value = 0;
-	    break;
-	case REP:
-	    ev.value = 2;
+    if ((outcnt == OUTBUF) && (flush_keys() != OK))
+	return WRITEERR;
+
+    ev = &(outbuf[outcnt++]);
+    memset(ev, 0, sizeof(struct input_event));
+    ev->type = EV_KEY;
+    ev->code = key;
+    ev->value = (type == KEY)?1:((type == REP)?2:0);
+
+    return OK;
+}
+
+
+/* The LEDs are those of the actual device */
+int set_led(int led, int on) {
+    struct input_event ev[2];
+
+    memset(ev, 0, sizeof(ev));
+    ev[0].type = EV_LED;
+    ev[0].code = led;
+    ev[0].value = (on > 0);
+    ev[1].type = EV_SYN;
+    ev[1].code = SYN_REPORT;
+
+    if (write(kbd->fd, ev, sizeof(ev)) != sizeof(ev)) {
+	lprintf("Error: failed to set LED at %s: %s", kbd->name, strerror(errno));
+	return WRITEERR;
+    }
+
+    return OK;
+}
+
+
+/*
+ * The event loop. All devices, the signals and the wakeups from other threads
+ * are waited for with a single epoll descriptor, or with io_uring, where
+ * each device has a read outstanding instead.
+ */
+
+/* Have the event loop wait for one of its own descriptors */
+static int watch_fd(int *fd) {
+    struct epoll_event ev;
+
+#ifdef HAVE_URING
+    if (useuring) {
+	if (ctlcnt == CTLS) {
+	    errno = ENOSPC;
+	    return INTERR;
+	}
+	ctls[ctlcnt].fd = fd;
+	ctls[ctlcnt].armed = 0;
+	ctls[ctlcnt].ready = 0;
+	++ctlcnt;
+	return OK;
+    }
+#endif
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, *fd, &ev) != 0)
+	return INTERR;
+
+    return OK;
+}
+
+
+int init_loop(int uring) {
+    if (uring) {
+#ifdef HAVE_URING
+	if (ring_setup() == OK) {
+	    useuring = 1;
+	    if (verbose > 1)
+		lprintf("Using io_uring for the event loop\n");
+	} else {
+	    lprintf("Warning: io_uring is not available (%s), using epoll\n", strerror(errno));
+	}
+#else
+	lprintf("Warning: io_uring support has not been compiled in, using epoll\n");
+#endif
+    }
+
+    if (!useuring) {
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+	    lprintf("Error: could not create the event loop: %s\n", strerror(errno));
+	    return INTERR;
+	}
+    }
+
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((wakefd < 0) || (watch_fd(&wakefd) != OK)) {
+	lprintf("Error: could not create the event loop: %s\n", strerror(errno));
+	return INTERR;
+    }
+
+    return OK;
+}
+
+
+/* The signals must have been blocked in all threads */
+int watch_signals(sigset_t *set) {
+    sigfd = signalfd(-1, set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if ((sigfd < 0) || (watch_fd(&sigfd) != OK)) {
+	lprintf("Error: could not set up the signal handling: %s\n", strerror(errno));
+	return INTERR;
+    }
+
+    return OK;
+}
+
+
+/* The descriptor changes when the fork server is restarted, and is -1 when
+ * there is none. A closed descriptor is dropped by epoll, while the io_uring
+ * polls are always submitted for the current one */
+int watch_server(int fd) {
+    static int watched = 0;
+
+    srvfd = fd;
+    if ((fd < 0) || (watched && useuring))
+	return OK;
+    watched = 1;
+
+    if (watch_fd(&srvfd) != OK) {
+	lprintf("Error: could not watch the fork server: %s\n", strerror(errno));
+	return INTERR;
+    }
+
+    return OK;
+}
+
+
+/* The watchdog timer of the commands */
+int watch_timer(int fd) {
+    timerfd = fd;
+    if (watch_fd(&timerfd) != OK) {
+	lprintf("Error: could not watch the command timer: %s\n", strerror(errno));
+	return INTERR;
+    }
+
+    return OK;
+}
+
+
+/* Devices that cannot be waited for are always ready, and are taken in turn
+ * with the others */
+static kbd_t *next_unpolled() {
+    static kbd_t *last = NULL;
+    kbd_t *dev;
+
+    for (dev = kbds; dev != NULL; dev = dev->next)
+	if (dev == last)
 	    break;
-	default:
-	    return EINVAL;
+    dev = (dev != NULL)?dev->next:kbds;
+    while ((dev != NULL) && dev->polled)
+	dev = dev->next;
+    if (dev == NULL)
+	for (dev = kbds; dev->polled; dev = dev->next);
+
+    last = dev;
+
+    return dev;
+}
+
+
+#ifdef HAVE_URING
+static int uring_wait(int *src, kbd_t **dev, int *signum) {
+    static kbd_t *last = NULL;
+    struct signalfd_siginfo si;
+    evbuf_t *buf;
+    uint64_t val;
+    kbd_t *d, *start;
+    int i, n;
+
+    while (1) {
+	/* The signals first, in case more are queued */
+	for (i = 0; i < ctlcnt; ++i) {
+	    if (!ctls[i].ready)
+		continue;
+
+	    if (ctls[i].fd == &sigfd) {
+		if (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+		    *src = SRC_SIGNAL;
+		    *signum = si.ssi_signo;
+		    return OK;
+		}
+		ctls[i].ready = 0;
+		continue;
+	    }
+
+	    ctls[i].ready = 0;
+	    if (ctls[i].fd == &wakefd) {
+		if (read(wakefd, &val, sizeof(val)) < 0)
+		    continue;
+		*src = SRC_WAKE;
+		return OK;
+	    }
+	    if (ctls[i].fd == &srvfd)
+		*src = SRC_SERVER;
+	    else if (ctls[i].fd == &timerfd)
+		*src = SRC_TIMER;
+	    else
+		*src = SRC_HOTPLUG;
+	    return OK;
+	}
+
+	/* The devices are taken in turn */
+	for (d = kbds; d != NULL; d = d->next)
+	    if (d == last)
+		break;
+	start = ((d != NULL) && (d->next != NULL))?d->next:kbds;
+	for (d = start; d != NULL; ) {
+	    buf = (evbuf_t *)(d->buf);
+	    if (buf->ready) {
+		buf->ready = 0;
+		last = d;
+		*src = SRC_DEV;
+		*dev = d;
+		return OK;
+	    }
+	    d = (d->next != NULL)?d->next:kbds;
+	    if (d == start)
+		break;
+	}
+
+	/* Keep a read outstanding on every device that has been drained, and
+	 * a poll on every other descriptor */
+	n = 0;
+	for (d = kbds; d != NULL; d = d->next) {
+	    buf = (evbuf_t *)(d->buf);
+	    if (buf->inflight || (buf->err != 0))
+		continue;
+	    if (buf_pending(buf)) {
+		buf->ready = 1;
+		++n;
+	    } else {
+		submit_read(d);
+	    }
+	}
+	for (i = 0; i < ctlcnt; ++i)
+	    if (!ctls[i].armed && !ctls[i].ready && (*(ctls[i].fd) >= 0))
+		submit_poll(&(ctls[i]));
+	if (n > 0)
+	    continue;
+
+	if (ring_enter(1) != OK) {
+	    lprintf("Error: could not wait for events: %s\n", strerror(errno));
+	    return INTERR;
+	}
+	ring_reap();
     }
+}
+#endif
+
 
-    ret = fwrite(&ev, sizeof(ev), 1, dev);
-    if (ret < 1) {
-	lprintf("Error: failed to send event to %s: %s", device, strerror(errno));
+int wait_loop(int *src, kbd_t **dev, int *signum) {
+    struct signalfd_siginfo si;
+    uint64_t val;
+    void *ptr;
+
+#ifdef HAVE_URING
+    if (useuring)
+	return uring_wait(src, dev, signum);
+#endif
+
+    while (1) {
+	if (looppos >= loopcnt) {
+	    looppos = 0;
+	    loopcnt = epoll_wait(epfd, loopev, LOOPEVS, (unpolled > 0)?0:-1);
+	    if (loopcnt < 0) {
+		loopcnt = 0;
+		if (errno == EINTR)
+		    continue;
+		lprintf("Error: could not wait for events: %s\n", strerror(errno));
+		return INTERR;
+	    }
+	    if ((loopcnt == 0) && (unpolled > 0)) {
+		*src = SRC_DEV;
+		*dev = next_unpolled();
+		return OK;
+	    }
+	}
+
+	ptr = loopev[looppos++].data.ptr;
+
+	if (ptr == NULL) {
+	    /* A device that has been closed in the meantime */
+	    continue;
+	} else if (ptr == &wakefd) {
+	    if (read(wakefd, &val, sizeof(val)) < 0)
+		continue;
+	    *src = SRC_WAKE;
+	    return OK;
+	} else if (ptr == &inofd) {
+	    *src = SRC_HOTPLUG;
+	    return OK;
+	} else if (ptr == &srvfd) {
+	    *src = SRC_SERVER;
+	    return OK;
+	} else if (ptr == &timerfd) {
+	    *src = SRC_TIMER;
+	    return OK;
+	} else if (ptr == &sigfd) {
+	    if (read(sigfd, &si, sizeof(si)) != sizeof(si))
+		continue;
+	    /* Check again, in case more signals are queued */
+	    --looppos;
+	    *src = SRC_SIGNAL;
+	    *signum = si.ssi_signo;
+	    return OK;
+	}
+
+	*src = SRC_DEV;
+	*dev = (kbd_t *)ptr;
+	return OK;
+    }
+}
+
+
+int wake_loop() {
+    uint64_t val = 1;
+
+    if (write(wakefd, &val, sizeof(val)) < 0)
 	return WRITEERR;
+
+    return OK;
+}
+
+
+/*
+ * The hotplug watcher. The directories of the device nodes are watched with
+ * inotify, so that devices are attached as soon as their nodes appear.
+ */
+
+/* Split a device name into its directory and file name */
+static char *dir_name(char *name, char **base) {
+    char *slash = strrchr(name, '/');
+
+    if (slash == NULL) {
+	*base = name;
+	return strdup(".");
+    }
+
+    *base = slash + 1;
+    if (slash == name)
+	return strdup("/");
+    return strndup(name, slash - name);
+}
+
+
+static int add_watch(char *dir) {
+    watch_t *tmp;
+    int i, wd;
+
+    wd = inotify_add_watch(inofd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+    if (wd < 0) {
+	lprintf("Warning: could not watch %s: %s\n", dir, strerror(errno));
+	free(dir);
+	return DEVFAIL;
+    }
+
+    /* The same directory is only watched once */
+    for (i = 0; i < watchcnt; ++i) {
+	if (watches[i].wd == wd) {
+	    free(dir);
+	    return OK;
+	}
     }
 
+    tmp = (watch_t *)(realloc(watches, (watchcnt + 1) * sizeof(watch_t)));
+    if (tmp == NULL) {
+	free(dir);
+	return MEMERR;
+    }
+    watches = tmp;
+    watches[watchcnt].wd = wd;
+    watches[watchcnt].dir = dir;
+    ++watchcnt;
+
+    if (verbose > 1)
+	lprintf("Watching %s for devices\n", dir);
+
     return OK;
 }
 
 
-int set_led(int led, int on) {
-    struct input_event ev;
-    int ret;
+/* Watch for devices to (re)attach - the specified devices, or the keyboards
+ * that appear later on if they were detected */
+int watch_devices(int detect, int all) {
+    char *base;
+    int i;
 
-    ev.type = EV_LED;
-    ev.code = led;
-    ev.value = (on > 0);
+    inofd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inofd < 0) {
+	lprintf("Warning: device hotplugging is not available: %s\n", strerror(errno));
+	return DEVFAIL;
+    }
 
-    ret = fwrite(&ev, sizeof(ev), 1, dev);
-    if (ret < 1) {
-	lprintf("Error: failed to set LED at %s: %s", device, strerror(errno));
-	return WRITEERR;
+    hotdetect = detect;
+    hotall = all;
+
+    if (detect) {
+	add_watch(strdup(DEVDIR));
+    } else {
+	for (i = 0; i < devcnt; ++i)
+	    add_watch(dir_name(devices[i], &base));
+    }
+
+    if (watchcnt == 0) {
+	close(inofd);
+	inofd = -1;
+	return DEVFAIL;
+    }
+
+    if (watch_fd(&inofd) != OK) {
+	lprintf("Warning: device hotplugging is not available: %s\n", strerror(errno));
+	close(inofd);
+	inofd = -1;
+	return DEVFAIL;
     }
 
     return OK;
 }
+
+
+static int is_open(char *name) {
+    kbd_t *dev;
+
+    for (dev = kbds; dev != NULL; dev = dev->next)
+	if (strcmp(dev->name, name) == 0)
+	    return 1;
+
+    return 0;
+}
+
+
+/* Find the device that a new directory entry stands for, if any */
+static char *hotplug_dev(watch_t *w, char *entry) {
+    char *dir, *base, *name;
+    int i;
+
+    for (i = 0; i < devcnt; ++i) {
+	dir = dir_name(devices[i], &base);
+	if (dir == NULL)
+	    return NULL;
+	if ((strcmp(base, entry) == 0) && (strcmp(dir, w->dir) == 0)) {
+	    free(dir);
+	    break;
+	}
+	free(dir);
+    }
+
+    if (!hotdetect)
+	return ((i < devcnt) && !is_open(devices[i]))?devices[i]:NULL;
+
+    /* The same node may be reused by any other device */
+    if ((strncmp(entry, "event", 5) != 0) || ((!hotall) && (kbds != NULL)))
+	return NULL;
+
+    if (i < devcnt) {
+	name = devices[i];
+	if (is_open(name))
+	    return NULL;
+    } else {
+	name = (char *)(malloc(strlen(w->dir) + strlen(entry) + 2));
+	if (name == NULL)
+	    return NULL;
+	sprintf(name, "%s/%s", w->dir, entry);
+    }
+
+    if (!usable_dev(name)) {
+	if (i == devcnt)
+	    free(name);
+	return NULL;
+    }
+
+    if ((i == devcnt) && (add_device(name) != OK)) {
+	free(name);
+	return NULL;
+    }
+
+    return name;
+}
+
+
+/* Get the next device to attach, or NULL when there is none */
+char *next_hotplug() {
+    struct inotify_event *ev;
+    ssize_t ret;
+    char *name;
+    int i;
+
+    while (1) {
+	if (inopos >= inobytes) {
+	    inopos = inobytes = 0;
+	    ret = read(inofd, inobuf, sizeof(inobuf));
+	    if (ret <= 0)
+		return NULL;
+	    inobytes = ret;
+	}
+
+	ev = (struct inotify_event *)(inobuf + inopos);
+	inopos += sizeof(struct inotify_event) + ev->len;
+
+	if ((ev->len == 0) || (ev->mask & IN_ISDIR))
+	    continue;
+
+	for (i = 0; i < watchcnt; ++i)
+	    if (watches[i].wd == ev->wd)
+		break;
+	if (i == watchcnt)
+	    continue;
+
+	name = hotplug_dev(&(watches[i]), ev->name);
+	if (name != NULL)
+	    return name;
+    }
+}
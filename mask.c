@@ -10,86 +10,187 @@
 
 #include "actkbd.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
-/* Active key mask */
-static unsigned char *mask = NULL;
-
-/* Ignored key mask */
-static unsigned char *ignmask = NULL;
-
-/* Key mask size */
-static int masksize = 0;
-
-
-int get_masksize() {
-    return masksize;
-}
-
-
-/* Mask initialisation */
-int init_mask(unsigned char **mask) {
-    /* Calculate the key mask size */
-    masksize = (maxkey + 1) / 8;
-    if (((maxkey + 1) % 8) > 0)
-	++masksize;
-
-    /* Allocate the key mask space */
-    *mask = (unsigned char *)(malloc(masksize));
-
-    memset(*mask, 0, masksize);
-
-    return OK;
-}
-
-
-/* Mask deallocation */
-void free_mask(unsigned char **mask) {
-    free(*mask);
-    *mask = NULL;
-}
 
 /* Mask zeroing */
-static void clear_mask(unsigned char **mask) {
-    memset(*mask, 0, masksize);
+void clear_mask(keymask_t *mask) {
+    memset(mask, 0, sizeof(keymask_t));
 }
 
 
 /* Mask comparison */
-static int cmp_mask(unsigned char *mask0, unsigned char* mask1, unsigned int attr) {
+static int cmp_mask(keymask_t *mask0, keymask_t *mask1, unsigned int attr) {
+    const uint64_t *w0 = mask0->w, *w1 = mask1->w;
     int i;
 
     /* Require that at least one mask0 bit is not set in mask1  */
     if ((attr & BIT_ATTR_NOT) != 0) {
-	for (i = 0; i < masksize; ++i)
-	    if ((mask0[i] & ~mask1[i]) != 0)
+	for (i = 0; i < MASK_WORDS; ++i)
+	    if ((w0[i] & ~w1[i]) != 0)
 		return 1;
 	return 0;
     }
 
     /* Require that all mask1 bits are present in mask0 */
     if ((attr & BIT_ATTR_ALL) != 0) {
-	for (i = 0; i < masksize; ++i)
-	    if ((mask0[i] & mask1[i]) != mask1[i])
+	for (i = 0; i < MASK_WORDS; ++i)
+	    if ((w0[i] & w1[i]) != w1[i])
 		return 0;
 	return 1;
     }
 
     /* True if any mask1 bits are present in mask0 */
     if ((attr & BIT_ATTR_ANY) != 0) {
-	for (i = 0; i < masksize; ++i)
-	    if ((mask0[i] & mask1[i]) != 0)
+	for (i = 0; i < MASK_WORDS; ++i)
+	    if ((w0[i] & w1[i]) != 0)
 		return 1;
 	return 0;
     }
 
     /* Require an exact match */
-    return (memcmp(mask0, mask1, masksize)  == 0);
+    for (i = 0; i < MASK_WORDS; ++i)
+	if (w0[i] != w1[i])
+	    return 0;
+    return 1;
+}
+
+
+/* Mask hashing */
+unsigned int hash_mask(uint64_t *words, int n) {
+    uint64_t hash = 0;
+    int i;
+
+    for (i = 0; i < n; ++i)
+	hash = (hash ^ words[i]) * 0x9e3779b97f4a7c15ull;
+
+    return (unsigned int)(hash ^ (hash >> 32));
+}
+
+
+/* Count the bits of a mask */
+int cnt_mask(keymask_t *mask) {
+    int i, n = 0;
+
+    for (i = 0; i < MASK_WORDS; ++i)
+	n += __builtin_popcountll(mask->w[i]);
+
+    return n;
+}
+
+
+/* Find the first set bit at or after a position, or -1 if there is none */
+int next_mask_bit(keymask_t *mask, int bit) {
+    uint64_t word;
+    int i;
+
+    if ((bit < 0) || (bit >= MASK_KEYS))
+	return -1;
+
+    i = bit / 64;
+    word = mask->w[i] & (~((uint64_t)0) << (bit % 64));
+    while (word == 0) {
+	if (++i >= MASK_WORDS)
+	    return -1;
+	word = mask->w[i];
+    }
+
+    return i * 64 + __builtin_ctzll(word);
+}
+
+
+/* Batch comparison kernels - find the first of n contiguous masks of the
+ * given number of words that is equal to the reference mask */
+static int find_mask_scalar(uint64_t *masks, int n, int words, uint64_t *ref) {
+    int i, j;
+
+    if (words == 1) {
+	for (i = 0; i < n; ++i)
+	    if (masks[i] == ref[0])
+		return i;
+	return -1;
+    }
+
+    for (i = 0; i < n; ++i, masks += words) {
+	uint64_t diff = 0;
+
+	for (j = 0; j < words; ++j)
+	    diff |= masks[j] ^ ref[j];
+	if (diff == 0)
+	    return i;
+    }
+
+    return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static int find_mask_sse2(uint64_t *masks, int n, int words, uint64_t *ref) {
+    int i, j;
+
+    for (i = 0; i < n; ++i, masks += words) {
+	__m128i eq = _mm_set1_epi32(-1);
+
+	for (j = 0; j < words; j += 2)
+	    eq = _mm_and_si128(eq, _mm_cmpeq_epi32(
+			_mm_loadu_si128((__m128i *)(ref + j)),
+			_mm_loadu_si128((__m128i *)(masks + j))));
+	if (_mm_movemask_epi8(eq) == 0xffff)
+	    return i;
+    }
+
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static int find_mask_avx2(uint64_t *masks, int n, int words, uint64_t *ref) {
+    int i, j;
+
+    for (i = 0; i < n; ++i, masks += words) {
+	__m256i diff = _mm256_setzero_si256();
+
+	for (j = 0; j < words; j += 4)
+	    diff = _mm256_or_si256(diff, _mm256_xor_si256(
+			_mm256_loadu_si256((__m256i *)(ref + j)),
+			_mm256_loadu_si256((__m256i *)(masks + j))));
+	if (_mm256_testz_si256(diff, diff))
+	    return i;
+    }
+
+    return -1;
+}
+
+static int have_sse2 = -1, have_avx2 = -1;
+#endif
+
+int find_mask(uint64_t *masks, int n, int words, uint64_t *ref) {
+    if (n <= 0)
+	return -1;
+
+#ifdef HAVE_X86_SIMD
+    if (have_avx2 < 0) {
+	__builtin_cpu_init();
+	have_sse2 = __builtin_cpu_supports("sse2");
+	have_avx2 = __builtin_cpu_supports("avx2");
+    }
+
+    /* Wide masks only - a single word is just a register compare */
+    if (have_avx2 && ((words % 4) == 0))
+	return find_mask_avx2(masks, n, words, ref);
+    if (have_sse2 && ((words % 2) == 0))
+	return find_mask_sse2(masks, n, words, ref);
+#endif
+
+    return find_mask_scalar(masks, n, words, ref);
 }
 
 
 /* Set a bit */
-static int set_bit(unsigned char *mask, int bit, int val) {
-    unsigned char byte = 1;
+static int set_bit(keymask_t *mask, int bit, int val) {
+    uint64_t word = 1;
 
     if ((bit < 0) || (bit > maxkey) || (val < 0) || (val > 1)) {
 	if (verbose > 1)
@@ -97,39 +198,31 @@ static int set_bit(unsigned char *mask, int bit, int val) {
 	return INTERR;
     }
 
-    byte = byte << (bit % 8);
+    word = word << (bit % 64);
 
     if (val == 0)
-	mask[bit / 8] = mask[bit / 8] & (~byte);
+	mask->w[bit / 64] &= ~word;
     else
-	mask[bit / 8] = mask[bit / 8] | byte;
+	mask->w[bit / 64] |= word;
 
     return OK;
 }
 
 /* Get a bit */
-static int get_bit(unsigned char *mask, int bit) {
-    unsigned char byte = 1;
-
+static int get_bit(keymask_t *mask, int bit) {
     if ((bit < 0) || (bit > maxkey)) {
 	lprintf("Error: invalid get_bit argument %i\n", bit);
 	return -1;
     }
 
-    byte = byte << (bit % 8);
-    return ((mask[bit / 8] & byte) > 0);
+    return ((mask->w[bit / 64] >> (bit % 64)) & 1);
 }
 
 
 /* Print a key mask */
-static int lprint_mask_delim(unsigned char *mask, char d) {
+static int lprint_mask_delim(keymask_t *mask, char d) {
     int i = 0, c = 0;
 
-    if (mask == NULL) {
-	lprintf("Error: attempt to dereference NULL mask pointer\n");
-	return INTERR;
-    }
-
     for (i = 0; i <= maxkey; ++i) {
 	if (get_bit(mask, i)) {
 	    ++c;
@@ -142,18 +235,15 @@ static int lprint_mask_delim(unsigned char *mask, char d) {
     return OK;
 }
 
-int lprint_mask(unsigned char *mask) {
+int lprint_mask(keymask_t *mask) {
     return lprint_mask_delim(mask, '+');
 }
 
 
 /* Use a A+B+N... string to initialise a key mask */
-int strmask(unsigned char **mask, char *keys) {
+int strmask(keymask_t *mask, char *keys) {
     int l, i, k;
 
-    /* Default mask pointer */
-    *mask = NULL;
-
     l = strlen(keys);
 
     /* Clean up the input */
@@ -166,17 +256,15 @@ int strmask(unsigned char **mask, char *keys) {
 	    return CONFERR;
     }
 
-    init_mask(mask);
+    clear_mask(mask);
 
     /* Set the key mask */
     i = 0;
     while (i < l) {
 	if (isdigit(keys[i])) {
 	    sscanf(keys + i, "%i", &k);
-	    if (set_bit(*mask, k, 1) != OK) {
-		free(*mask);
+	    if (set_bit(mask, k, 1) != OK)
 		return CONFERR;
-	    }
 	    while (isdigit(keys[i]))
 		++i;
 	} else {
@@ -188,81 +276,127 @@ int strmask(unsigned char **mask, char *keys) {
 }
 
 
-/* The active key mask */
-int init_key_mask() {
-    return init_mask(&mask);
-}
-
-void free_key_mask() {
-    free_mask(&mask);
+/* The active key mask of the current device */
+void clear_key_mask() {
+    clear_mask(&(kbd->keys));
+    clear_mask(&(kbd->virt));
+    update_match(-1, 0);
 }
 
-void clear_key_mask() {
-    clear_mask(&mask);
+keymask_t *get_key_mask() {
+    return &(kbd->keys);
 }
 
 int set_key_bit(int bit, int val) {
-    return set_bit(mask, bit, val);
+    int ret, old;
+
+    old = ((bit >= 0) && (bit <= maxkey))?get_bit(&(kbd->keys), bit):-1;
+    ret = set_bit(&(kbd->keys), bit, val);
+
+    /* Only actual transitions affect the rule counters */
+    if ((ret == OK) && (old != val))
+	update_match(bit, val);
+
+    return ret;
 }
 
 #if UNUSED
 int get_key_bit(int bit) {
-    return get_bit(mask, bit);
+    return get_bit(&(kbd->keys), bit);
 }
 #endif
 
-int cmp_key_mask(unsigned char *mask0, unsigned int attr) {
-    return cmp_mask(mask, mask0, attr);
+int cmp_key_mask(keymask_t *mask0, unsigned int attr) {
+    return cmp_mask(&(kbd->keys), mask0, attr);
+}
+
+/* Count the active keys in a mask, or all of them if it is NULL */
+int cnt_key_mask(keymask_t *mask0) {
+    keymask_t tmp;
+    int i;
+
+    if (mask0 == NULL)
+	return cnt_mask(&(kbd->keys));
+
+    for (i = 0; i < MASK_WORDS; ++i)
+	tmp.w[i] = kbd->keys.w[i] & mask0->w[i];
+
+    return cnt_mask(&tmp);
+}
+
+/* Bring the active key mask in line with the actual key state, for the keys
+ * that the device has. Keys whose release is being ignored stay pressed, and
+ * the keys that the rules have set or unset are left alone. Returns the
+ * number of keys that changed */
+int sync_key_mask(keymask_t *state, keymask_t *avail) {
+    uint64_t diff;
+    int i, k, n = 0;
+
+    for (i = 0; i < MASK_WORDS; ++i) {
+	diff = (kbd->keys.w[i] ^ state->w[i]) & avail->w[i] & ~kbd->virt.w[i];
+	if (kbd->ignrel)
+	    diff &= ~(kbd->ign.w[i] & ~state->w[i]);
+
+	while (diff != 0) {
+	    k = i * 64 + __builtin_ctzll(diff);
+	    diff &= diff - 1;
+	    if (k > maxkey)
+		break;
+	    set_key_bit(k, (state->w[i] >> (k % 64)) & 1);
+	    ++n;
+	}
+    }
+
+    return n;
 }
 
 #if UNUSED
 int lprint_key_mask_delim(char d) {
-    return lprint_mask_delim(mask, d);
+    return lprint_mask_delim(&(kbd->keys), d);
 }
 #endif
 
 int lprint_key_mask() {
-    return lprint_mask(mask);
-}
-
-
-/* The ignored key mask */
-int init_ign_mask() {
-    return init_mask(&ignmask);
+    return lprint_mask(&(kbd->keys));
 }
 
-void free_ign_mask() {
-    free_mask(&ignmask);
-}
 
-#if UNUSED
+/* The ignored key mask of the current device */
 void clear_ign_mask() {
-    clear_mask(&ignmask);
+    clear_mask(&(kbd->ign));
 }
 
+#if UNUSED
 int set_ign_bit(int bit, int val) {
-    return set_bit(ignmask, bit, val);
+    return set_bit(&(kbd->ign), bit, val);
 }
 #endif
 
 int get_ign_bit(int bit) {
-    return get_bit(ignmask, bit);
+    return get_bit(&(kbd->ign), bit);
 }
 
 #if UNUSED
-int cmp_ign_mask(unsigned char *mask0, unsigned int attr) {
-    return cmp_mask(ignmask, mask0, attr);
+int cmp_ign_mask(keymask_t *mask0, unsigned int attr) {
+    return cmp_mask(&(kbd->ign), mask0, attr);
 }
 
 int lprint_ign_mask_delim(char d) {
-    return lprint_mask_delim(ignmask, d);
+    return lprint_mask_delim(&(kbd->ign), d);
 }
 
 int lprint_ign_mask() {
-    return lprint_mask(ignmask);
+    return lprint_mask(&(kbd->ign));
 }
 #endif
 
 void copy_key_to_ign_mask() {
-    memcpy(ignmask, mask, masksize);
+    kbd->ign = kbd->keys;
+}
+
+
+/* The virtual key mask of the current device - the keys whose state was last
+ * changed by a set() or unset() attribute rather than by the device */
+int set_virt_bit(int bit, int val) {
+    return set_bit(&(kbd->virt), bit, val);
 }